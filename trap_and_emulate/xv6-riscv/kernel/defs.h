@@ -10,6 +10,8 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vminfo;
+struct vm_virtual_state;
 
 // bio.c
 void            binit(void);
@@ -35,6 +37,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filewritek(struct file*, char*, int n);
 
 // fs.c
 void            fsinit(int);
@@ -64,6 +67,8 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void            kdup(void *);
+int             krefs(void *);
 void            kinit(void);
 
 // log.c
@@ -87,6 +92,9 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             vmclone(int);
+int             vmrestore(int);
+int             vcpufork(struct proc*, int);
 int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
@@ -149,6 +157,8 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            vmtrap(void);
+void            timerarm(uint64);
 
 // uart.c
 void            uartinit(void);
@@ -168,6 +178,7 @@ uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
+void            uvmfreetable(pagetable_t);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
@@ -194,6 +205,88 @@ void            dump_hex(const void* data, size_t size);
 void            trap_and_emulate(void);
 void            trap_and_emulate_ecall(void);
 void            trap_and_emulate_init(void);
+int             trap_and_emulate_vminit(struct proc*, pagetable_t);
+void            trap_and_emulate_vmfree(struct proc*);
+int             trap_and_emulate_info(int, struct vminfo*);
+int             trap_and_emulate_wpfault(struct proc*, uint64);
+int             trap_and_emulate_ctl(int, int, uint64);
+int             trap_and_emulate_trace(int, uint64, int);
+void            trap_and_emulate_raise(struct proc*, uint64, uint64);
+void            trap_and_emulate_intr(struct proc*);
+void            trap_and_emulate_timer(void);
+int             trap_and_emulate_vmclone(struct proc*, struct vm_virtual_state*);
+int             trap_and_emulate_vcpu(struct proc*, struct vm_virtual_state*, int);
+void            trap_and_emulate_exitstart(struct proc*, uint64);
+void            trap_and_emulate_exitend(struct proc*);
+int             trap_and_emulate_stat(int, uint64);
+void            trap_and_emulate_flush(struct proc*);
+int             trap_and_emulate_fetch(struct proc*, uint64, uint32*);
+
+// hypercall.c
+void            hypercall(struct proc*);
+void            cons_write(struct proc*, char*, int);
+
+// mmio.c
+int             mmio_fault(struct proc*, uint64, uint64, uint64);
+int             mmio_fast(struct proc*, uint64, uint64);
+void            mmio_flush(struct proc*);
+
+// patch.c
+void            patch_csrr(struct proc*, uint64, int, uint64);
+
+// pmp.c
+pagetable_t     pmp_pagetable(struct proc*);
+int             pmp_map(struct proc*, uint64);
+int             pmp_access(struct proc*, uint64);
+void            pmp_changed(struct proc*);
+void            pmp_free(struct proc*);
+
+// vcpu.c
+void            vcpu_init(void);
+void            vcpu_start(struct proc*);
+void            vcpu_share(struct proc*, struct proc*, int);
+int             vcpu_free(struct proc*);
+void            vcpu_kill(struct proc*);
+void            vcpu_msip(struct proc*, int, int);
+
+// vmimage.c
+struct proghdr;
+void            vmimage_init(void);
+int             vmimage_map(pagetable_t, struct inode*, struct proghdr*);
+void            vmimage_forget(struct inode*);
+
+// vmmem.c
+void            vmmem_init(void);
+int             vmmem_fault(struct proc*, uint64, int);
+int             vmmem_populate(struct proc*);
+void            vmmem_free(struct proc*);
+int             vmmem_snapshot(int, int);
+int             vmmem_clone(struct proc*, int);
+char*           vmmem_private(struct proc*, uint64);
+void            vmmem_protect(struct proc*);
+int             vmmem_leaves(pagetable_t, int, uint64, int (*)(pte_t*, uint64, void*), void*);
+
+// vmmerge.c
+void            vmmerge_init(void);
+int             vmmerge_scan(int, uint64);
+
+// vmckpt.c
+struct vmckpt;
+int             vmckpt_save(int, int);
+struct vmckpt*  vmckpt_open(int);
+int             vmckpt_restore(struct proc*, struct vmckpt*);
+void            vmckpt_close(struct vmckpt*);
+int             vmckpt_fault(struct proc*, uint64, int);
+void            vmckpt_forget(struct proc*, uint64, uint64);
+void            vmckpt_park(struct proc*);
+void            vmckpt_exit(struct proc*);
+
+// shadow.c
+void            shadow_switch(struct proc*);
+int             shadow_pagefault(struct proc*, uint64, uint64);
+void            shadow_sfence(struct proc*, uint64, uint64, int, int);
+void            shadow_flush(struct proc*);
+int             shadow_gpa(struct proc*, uint64, int, uint64*);
 
 
 // number of elements in fixed-size array
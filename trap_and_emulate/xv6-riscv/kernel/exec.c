@@ -7,6 +7,10 @@
 #include "defs.h"
 #include "elf.h"
 
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
 int flags2perm(int flags)
@@ -23,7 +27,7 @@ int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, n, off, isvm, shared = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
@@ -46,6 +50,12 @@ exec(char *path, char **argv)
   if(elf.magic != ELF_MAGIC)
     goto bad;
 
+  // Save program name for debugging.
+  for(last=s=path; *s; s++)
+    if(*s == '/')
+      last = s+1;
+  isvm = strncmp(last, "vm-", 3) == 0;
+
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
@@ -62,6 +72,20 @@ exec(char *path, char **argv)
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
     uint64 sz1;
+    // CSE 536: VMs running the same image share its read-only
+    // segments; see vmimage.c.
+    if(isvm && (ph.flags & ELF_PROG_FLAG_WRITE) == 0 && ph.vaddr >= sz){
+      if(ph.vaddr > sz){
+        if((sz1 = uvmalloc(pagetable, sz, ph.vaddr, flags2perm(ph.flags))) == 0)
+          goto bad;
+        sz = sz1;
+      }
+      if((n = vmimage_map(pagetable, ip, &ph)) >= 0){
+        sz = ph.vaddr + ph.memsz;
+        shared += n;
+        continue;
+      }
+    }
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
     sz = sz1;
@@ -114,10 +138,14 @@ exec(char *path, char **argv)
   // value, which goes in a0.
   p->trapframe->a1 = sp;
 
-  // Save program name for debugging.
-  for(last=s=path; *s; s++)
-    if(*s == '/')
-      last = s+1;
+  // CSE 536: give the VM its own virtual CPU state. Its RAM
+  // is allocated a page at a time as the guest touches it.
+  if (isvm) {
+    if(trap_and_emulate_vminit(p, pagetable) < 0)
+      goto bad;
+    p->vm_state->imageshared = shared;
+  }
+
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
@@ -127,17 +155,11 @@ exec(char *path, char **argv)
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
-
-  // CSE 536: Allocate 4MB of memory for the VM starting from memaddr.
-  if (strncmp(p->name, "vm-", 3) == 0) {
-    uint64 memaddr = 0x80000000;
-    if((sz1 = uvmalloc(pagetable, memaddr, memaddr + 1024*PGSIZE, PTE_W)) == 0) {
-      printf("Error: could not allocate memory at 0x80000000 for VM.\n");
-      goto bad;
-    }
-    printf("Created a VM process and allocated memory region (%p - %p).\n", memaddr, memaddr + 1024*PGSIZE);
-    trap_and_emulate_init();
-  }
+  p->proc_te_vm = isvm;
+  if(!isvm)
+    trap_and_emulate_vmfree(p);
+  else if(p->vmcfg.ncpu > 1)
+    vcpu_start(p);  // the VM's other vCPUs, from the same entry
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -130,9 +130,10 @@ fileread(struct file *f, uint64 addr, int n)
 }
 
 // Write to file f.
-// addr is a user virtual address.
-int
-filewrite(struct file *f, uint64 addr, int n)
+// user_src indicates whether addr is a user virtual address
+// or a kernel address.
+static int
+filewrite1(struct file *f, int user_src, uint64 addr, int n)
 {
   int r, ret = 0;
 
@@ -140,11 +141,13 @@ filewrite(struct file *f, uint64 addr, int n)
     return -1;
 
   if(f->type == FD_PIPE){
+    if(!user_src)
+      return -1;
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
-    ret = devsw[f->major].write(1, addr, n);
+    ret = devsw[f->major].write(user_src, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
@@ -161,7 +164,7 @@ filewrite(struct file *f, uint64 addr, int n)
 
       begin_op();
       ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
+      if ((r = writei(f->ip, user_src, addr + i, f->off, n1)) > 0)
         f->off += r;
       iunlock(f->ip);
       end_op();
@@ -180,3 +183,19 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write to file f.
+// addr is a user virtual address.
+int
+filewrite(struct file *f, uint64 addr, int n)
+{
+  return filewrite1(f, 1, addr, n);
+}
+
+// Write n bytes at kernel address src to file f, which
+// must not be a pipe.
+int
+filewritek(struct file *f, char *src, int n)
+{
+  return filewrite1(f, 0, (uint64)src, n);
+}
+
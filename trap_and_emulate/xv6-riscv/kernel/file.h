@@ -20,6 +20,7 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int vmimage;        // CSE 536: may be a cached VM image; see vmimage.c
 
   short type;         // copy of disk inode
   short major;
@@ -429,6 +429,8 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->vmimage)
+    vmimage_forget(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -518,6 +520,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  // CSE 536: VMs may run this file from the image cache.
+  if(ip->vmimage)
+    vmimage_forget(ip);
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -0,0 +1,273 @@
+// Hypercalls: services that the hypervisor offers a guest
+// kernel in one exit, in place of the emulated device and
+// CSR accesses that the same service would otherwise take.
+// See hypercall.h for the ABI.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+#include "hypercall.h"
+
+// Write n bytes at kernel address buf to the guest's console:
+// the file that vmctl(VMCTL_CONSFD) chose, if it is still
+// open, else the host console.
+void cons_write(struct proc *p, char *buf, int n)
+{
+    int fd = p->vmcfg.consfd;
+
+    if (fd >= 0 && fd < NOFILE && p->ofile[fd])
+        filewritek(p->ofile[fd], buf, n);
+    else
+        devsw[CONSOLE].write(0, (uint64)buf, n);
+    p->vm_state->consbytes += n;
+}
+
+// Write len bytes at guest-physical address buf to the console.
+// Returns the number written, or -1 if none could be read.
+static uint64 hc_puts(struct proc *p, uint64 buf, uint64 len)
+{
+    pagetable_t pt;
+    char chunk[64];
+    uint64 n, done = 0;
+
+    if ((pt = pmp_pagetable(p)) == 0)
+        return -1;
+    if (len > HC_MAXPUTS)
+        len = HC_MAXPUTS;
+    while (done < len)
+    {
+        n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+        // a page of a restored VM may still be in its checkpoint.
+        if (copyin(pt, chunk, buf + done, n) < 0 &&
+            (vmmem_fault(p, buf + done, 0) < 0 || copyin(pt, chunk, buf + done, n) < 0))
+            break;
+        cons_write(p, chunk, n);
+        done += n;
+    }
+    return done == 0 && len > 0 ? -1 : done;
+}
+
+// The guest's console ring, in the host page behind it, or 0
+// if it has none, or S-mode may not write that page. A page
+// the guest has not touched yet, or shares copy-on-write, is
+// made its own first, since the hypervisor writes to it.
+static struct hcons *cons_ring(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    pagetable_t pt;
+    pte_t *pte;
+
+    if (vs->cons_ring == 0 || (pt = pmp_pagetable(p)) == 0)
+        return 0;
+    pte = walk(pt, vs->cons_ring, 0);
+    if ((pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_COW)) &&
+        vmmem_fault(p, vs->cons_ring, 1) == 0)
+        pte = walk(pt, vs->cons_ring, 0);
+    if (pte == 0 || (*pte & (PTE_V | PTE_U | PTE_R)) != (PTE_V | PTE_U | PTE_R) ||
+        (*pte & (PTE_W | PTE_WP)) == 0)
+        return 0;
+    return (struct hcons *)PTE2PA(*pte);
+}
+
+// Set up the console ring in the guest-physical page at gpa,
+// or take it down if gpa is 0.
+static uint64 hc_consring(struct proc *p, uint64 gpa)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (gpa % PGSIZE != 0 || gpa >= MAXVA)
+        return -1;
+    vs->cons_ring = gpa;
+    if (gpa != 0 && cons_ring(p) == 0)
+    {
+        vs->cons_ring = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Write out what the guest has put in its console ring.
+// cons_write() may sleep, and by the time it returns the ring's
+// page may be shared copy-on-write, by vmsnapshot() or vmmerge,
+// so the bytes are copied out and cons advanced before writing.
+// Returns the number of bytes, or -1 if the ring is missing
+// or corrupt.
+static uint64 hc_conskick(struct proc *p)
+{
+    struct hcons *ring;
+    uint32 prod, cons, n, m;
+    char *buf;
+
+    if ((ring = cons_ring(p)) == 0)
+        return -1;
+    prod = ring->prod;
+    cons = ring->cons;
+    if (prod >= HCONS_SIZE || cons >= HCONS_SIZE)
+        return -1;
+
+    n = (prod + HCONS_SIZE - cons) % HCONS_SIZE;
+    if (n == 0)
+        return 0;
+    if ((buf = kalloc()) == 0)
+        return -1;
+    // the bytes may wrap around the end of data.
+    m = cons > prod ? HCONS_SIZE - cons : n;
+    memmove(buf, ring->data + cons, m);
+    memmove(buf + m, ring->data, n - m);
+    ring->cons = prod;
+    cons_write(p, buf, n);
+    kfree(buf);
+    return n;
+}
+
+// Wait up to wait host clock ticks for the host to change the
+// balloon's target from what the last call returned, or for a
+// checkpoint of the VM to stop it (see vmckpt.c). Returns the
+// pages to inflate the balloon by to meet it, or, as a
+// negative number, to deflate it by.
+static uint64 hc_balloon(struct proc *p, uint64 wait)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint start;
+
+    // as halt() does, flush output before waiting.
+    mmio_flush(p);
+    acquire(&tickslock);
+    start = ticks;
+    // vmmerge may remap the VM's pages meanwhile.
+    vs->idle = true;
+    // vmctl() does not wake us; the target is checked each tick.
+    while (vs->balloon_target == vs->balloon_seen && ticks - start < wait && !killed(p) &&
+           !vs->ckpt_pause)
+        sleep(&ticks, &tickslock);
+    vs->idle = false;
+    release(&tickslock);
+    vs->balloon_seen = vs->balloon_target;
+    return vs->balloon_seen - vs->balloon;
+}
+
+// Whether npages pages of guest RAM from guest-physical address
+// base are a valid balloon range.
+static bool balloon_range(struct vm_virtual_state *vs, uint64 base, uint64 npages)
+{
+    return base % PGSIZE == 0 && base >= VMRAMBASE && npages <= vs->memsize / PGSIZE &&
+           base + npages * PGSIZE <= VMRAMBASE + vs->memsize;
+}
+
+// Put npages pages of guest RAM from base in the balloon: unmap
+// them and free their host pages, if any. The next touch of one
+// maps a zeroed page, as on first touch.
+// Returns npages, or -1 if the range is not guest RAM.
+static uint64 hc_inflate(struct proc *p, uint64 base, uint64 npages)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 freed = 0;
+    pte_t *pte;
+
+    // vCPUs share the page tables, which must not change under
+    // them; see vcpu.c.
+    if (vs->group || !balloon_range(vs, base, npages))
+        return -1;
+    for (uint64 a = base; a < base + npages * PGSIZE; a += PGSIZE)
+    {
+        if ((pte = walk(vs->og_pagetable, a, 0)) != 0 && (*pte & PTE_V))
+        {
+            kfree((void *)PTE2PA(*pte));
+            *pte = 0;
+            freed++;
+        }
+        if (vs->pmp_pagetable && (pte = walk(vs->pmp_pagetable, a, 0)) != 0)
+            *pte = 0;
+    }
+    // shadow_switch() builds new ones after the hypercall; and
+    // the decode cache may hold instructions from freed pages.
+    if (freed)
+    {
+        shadow_flush(p);
+        trap_and_emulate_flush(p);
+    }
+    vmckpt_forget(p, base, npages);
+    vs->balloon += npages;
+    vs->ballooned += freed;
+    return npages;
+}
+
+// Take npages pages of guest RAM from base out of the balloon.
+// Returns npages, or -1 if the range is not guest RAM.
+static uint64 hc_deflate(struct proc *p, uint64 base, uint64 npages)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (!balloon_range(vs, base, npages))
+        return -1;
+    vs->balloon -= npages < vs->balloon ? npages : vs->balloon;
+    return npages;
+}
+
+// Handle a hypercall from guest S-mode: the ecall at the
+// guest's epc with HC_MAGIC in a7.
+void hypercall(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct trapframe *tf = p->trapframe;
+    uint64 ret;
+
+    vs->hypercalls++;
+    switch (tf->a6)
+    {
+    case HC_PROBE:
+        ret = HC_VERSION;
+        break;
+    case HC_PUTS:
+        ret = hc_puts(p, tf->a0, tf->a1);
+        break;
+    case HC_TIME:
+        ret = r_time();
+        break;
+    case HC_YIELD:
+        yield();
+        ret = 0;
+        break;
+    case HC_SETTIMER:
+        // trap_and_emulate_intr() updates mip.MTIP and arms
+        // the host timer on the way back to the guest.
+        vs->mtimecmp = tf->a0;
+        ret = 0;
+        break;
+    case HC_MEMINFO:
+        tf->a1 = VMRAMBASE;
+        ret = vs->memsize;
+        break;
+    case HC_CONSRING:
+        ret = hc_consring(p, tf->a0);
+        break;
+    case HC_CONSKICK:
+        ret = hc_conskick(p);
+        break;
+    case HC_BALLOON:
+        ret = hc_balloon(p, tf->a0);
+        break;
+    case HC_INFLATE:
+        ret = hc_inflate(p, tf->a0, tf->a1);
+        break;
+    case HC_DEFLATE:
+        ret = hc_deflate(p, tf->a0, tf->a1);
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+    tf->a0 = ret;
+    tf->epc += 4;
+}
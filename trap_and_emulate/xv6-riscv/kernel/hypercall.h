@@ -0,0 +1,60 @@
+// Hypercall ABI, shared by the hypervisor and the guests in vm/
+// (which wrap it in vm/hypercall.c).
+//
+// A guest in S-mode makes a hypercall with ecall, a7 set to
+// HC_MAGIC, the call number in a6 and arguments in a0-a5. The
+// hypervisor handles it in a single exit and resumes the guest
+// after the ecall with the result in a0, -1 on error; other
+// registers are preserved. An ecall without HC_MAGIC in a7,
+// or from U-mode, traps to the guest as usual.
+//
+// Buffers are given by guest-physical address, and must be
+// accessible to S-mode under the guest's PMP settings.
+
+#define HC_MAGIC    0x48564d58  // "HVMX"
+
+#define HC_PROBE    0   // () -> HC_VERSION
+#define HC_PUTS     1   // (buf, len) -> bytes written to the host console
+#define HC_TIME     2   // () -> mtime
+#define HC_YIELD    3   // () -> 0, after giving up the host CPU
+#define HC_SETTIMER 4   // (deadline) -> 0; sets the CLINT's mtimecmp
+#define HC_MEMINFO  5   // () -> bytes of RAM, and a1 = its guest-physical base
+#define HC_CONSRING 6   // (page) -> 0; sets up the console ring, 0 takes it down
+#define HC_CONSKICK 7   // () -> bytes drained from the console ring
+#define HC_BALLOON  8   // (ticks) -> pages to inflate the balloon by, negative to deflate
+#define HC_INFLATE  9   // (base, npages) -> npages, after freeing them on the host
+#define HC_DEFLATE  10  // (base, npages) -> npages taken back
+
+#define HC_VERSION  2   // 2 added the balloon
+
+#define HC_MAXPUTS  1024  // most bytes that HC_PUTS writes per call
+
+// Console ring, for bulk guest output: a page of guest RAM,
+// shared with the hypervisor. prod and cons are offsets into
+// data. The guest copies output into data from prod onwards,
+// wrapping at HCONS_SIZE, and advances prod past it; then, as
+// rarely as it likes, it kicks the hypervisor with HC_CONSKICK
+// to write out the bytes from cons to prod and set cons to
+// prod. The ring is empty when prod == cons, so it holds at
+// most HCONS_SIZE - 1 bytes. Output goes to the host console,
+// or to the file that vmctl(VMCTL_CONSFD) chose.
+#define HCONS_SIZE  (4096 - 8)
+
+struct hcons {
+  uint32 prod;              // written by the guest
+  uint32 cons;              // written by the hypervisor
+  char data[HCONS_SIZE];
+};
+
+// Memory balloon, for giving guest RAM back to the host. The
+// host sets how many pages it wants with vmctl(VMCTL_BALLOON).
+// A guest thread that has nothing else to do waits in
+// HC_BALLOON, which returns as soon as the host changes the
+// target, or after the given number of host clock ticks, with
+// how far the balloon is from it. The guest inflates the balloon by passing
+// pages of RAM it will not use to HC_INFLATE, whose host pages
+// are freed, and deflates it by passing some of them back to
+// HC_DEFLATE. A page read after HC_DEFLATE, or even before it,
+// reads as zeroes. The balloon is the guest's own count of the
+// pages it passed; the host pages actually freed are counted
+// by vminfo(), as ballooned.
@@ -23,10 +23,22 @@ struct {
   struct run *freelist;
 } kmem;
 
+// CSE 536: reference counts of pages, which VM templates and
+// their clones share copy-on-write. kalloc() returns a page
+// with one reference; kfree() drops one, and frees the page
+// when none are left.
+struct {
+  struct spinlock lock;
+  int count[(PHYSTOP - KERNBASE) / PGSIZE];
+} kref;
+
+#define KREF(pa) kref.count[((uint64)(pa) - KERNBASE) / PGSIZE]
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&kref.lock, "kref");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,8 +47,10 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    KREF(p) = 1;
     kfree(p);
+  }
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -51,6 +65,15 @@ kfree(void *pa)
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  acquire(&kref.lock);
+  if(KREF(pa) < 1)
+    panic("kfree: ref");
+  if(--KREF(pa) > 0){
+    release(&kref.lock);
+    return;
+  }
+  release(&kref.lock);
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
@@ -76,7 +99,34 @@ kalloc(void)
     kmem.freelist = r->next;
   release(&kmem.lock);
 
-  if(r)
+  if(r){
     memset((char*)r, 5, PGSIZE); // fill with junk
+    acquire(&kref.lock);
+    KREF(r) = 1;
+    release(&kref.lock);
+  }
   return (void*)r;
 }
+
+// Add a reference to page pa, which is in use.
+void
+kdup(void *pa)
+{
+  acquire(&kref.lock);
+  if(KREF(pa) < 1)
+    panic("kdup");
+  KREF(pa)++;
+  release(&kref.lock);
+}
+
+// The number of references to page pa.
+int
+krefs(void *pa)
+{
+  int n;
+
+  acquire(&kref.lock);
+  n = KREF(pa);
+  release(&kref.lock);
+  return n;
+}
@@ -0,0 +1,384 @@
+// Virtual devices for VMs.
+//
+// The host page tables map only the guest's RAM and text, so a
+// guest load or store to a device register faults into vmtrap().
+// mmio_fault() finds the device at the faulting guest-physical
+// address in mmiodevs[], decodes the load or store, and does
+// the access on the guest's behalf through the device's read
+// or write function.
+//
+// A guest that polls and writes a device register in a loop,
+// as console code does with the UART, faults on the same
+// device page again and again. mmio_fault() remembers the last
+// page it emulated an access to, like a TLB entry, and vmtrap()
+// hands the next fault there to mmio_fast(), which skips the
+// guest page table walk and the rest of a full exit. Whatever
+// would flush the guest's TLB forgets it: sfence.vma, a new
+// shadow, a PMP change.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+// A load or store decoded by mmio_decode().
+struct mmio_op
+{
+    int len;        // instruction length, 2 or 4
+    int store;      // 1 for a store, 0 for a load
+    int size;       // access size in bytes
+    int sext;       // loads: sign-extend the value
+    int reg;        // loads: rd, stores: rs2
+};
+
+// Device register access at offset off from the device's base,
+// of size bytes, naturally aligned. Return 0 on success, -1 for
+// an access fault.
+struct mmiodev
+{
+    uint64 base;
+    uint64 size;
+    int (*read)(struct proc *p, uint64 off, int size, uint64 *val);
+    int (*write)(struct proc *p, uint64 off, int size, uint64 val);
+};
+
+// Virtual CLINT: each vCPU's msip and mtimecmp are its own,
+// mtime is the host's time. The registers are 64 bits, except
+// msip, of which there are two to a doubleword; narrower
+// accesses read or write part of one. A vCPU that writes
+// another's msip sends it an interrupt, see vcpu_msip(); other
+// vCPUs' registers otherwise read as zero and ignore writes.
+
+static int clint_read(struct proc *p, uint64 off, int size, uint64 *val)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 hart = vs->csr[VCSR_MHARTID];
+    uint64 dw = off & ~7UL;
+    uint64 reg = 0;
+
+    if (dw < CLINT_MTIMECMP(0) - CLINT)
+    {
+        if (dw / 4 == (hart & ~1UL) && (vs->csr[VCSR_MIP] & MIP_MSIP))
+            reg = 1UL << ((hart & 1) * 32);
+    }
+    else if (dw == CLINT_MTIMECMP(hart) - CLINT)
+        reg = vs->mtimecmp;
+    else if (dw == CLINT_MTIME - CLINT)
+        reg = r_time();
+    *val = reg >> ((off & 7) * 8);
+    return 0;
+}
+
+static int clint_write(struct proc *p, uint64 off, int size, uint64 val)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 hart = vs->csr[VCSR_MHARTID];
+    uint64 dw = off & ~7UL;
+    int shift = (off & 7) * 8;
+    uint64 mask = (size == 8 ? ~0UL : (1UL << (size * 8)) - 1) << shift;
+
+    val <<= shift;
+    if (dw < CLINT_MTIMECMP(0) - CLINT)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            uint64 h = dw / 4 + i;
+            int set = (val >> (i * 32)) & 1;
+
+            if (((mask >> (i * 32)) & 1) == 0)
+                continue;
+            if (h != hart)
+                vcpu_msip(p, h, set);
+            else if (set)
+                vs->csr[VCSR_MIP] |= MIP_MSIP;
+            else
+                vs->csr[VCSR_MIP] &= ~MIP_MSIP;
+        }
+    }
+    else if (dw == CLINT_MTIMECMP(hart) - CLINT)
+    {
+        // trap_and_emulate_intr() updates mip.MTIP and arms
+        // the host timer on the way back to the guest.
+        vs->mtimecmp = (vs->mtimecmp & ~mask) | (val & mask);
+    }
+    return 0;
+}
+
+// Virtual 16550 UART, output only. The transmitter is always
+// idle, so a guest never waits to send; bytes it sends collect
+// in vs->uart.buf and go to the guest's console (see cons_write()
+// in hypercall.c) in one write at a newline, when the buffer
+// fills, or at the end of the next full exit. There is never
+// input to receive, and the UART raises no interrupts.
+
+#define UART_RHR 0            // receive holding register (read)
+#define UART_THR 0            // transmit holding register (write)
+#define UART_IER 1            // interrupt enable register
+#define UART_ISR 2            // interrupt status register (read)
+#define UART_FCR 2            // FIFO control register (write)
+#define UART_LCR 3            // line control register
+#define UART_LCR_DLAB 0x80    // divisor latch in place of RHR/THR and IER
+#define UART_MCR 4            // modem control register
+#define UART_LSR 5            // line status register
+#define UART_LSR_TX_IDLE 0x60 // THR empty and transmitter idle
+#define UART_MSR 6            // modem status register
+#define UART_SCR 7            // scratch register
+
+static int uart_read(struct proc *p, uint64 off, int size, uint64 *val)
+{
+    struct vuart *u = &p->vm_state->uart;
+    bool dlab = (u->lcr & UART_LCR_DLAB) != 0;
+
+    switch (off)
+    {
+    case UART_RHR:
+        *val = dlab ? u->dll : 0;
+        break;
+    case UART_IER:
+        *val = dlab ? u->dlm : u->ier;
+        break;
+    case UART_ISR:
+        *val = 0xC1;          // FIFOs enabled, no interrupt pending
+        break;
+    case UART_LCR:
+        *val = u->lcr;
+        break;
+    case UART_MCR:
+        *val = u->mcr;
+        break;
+    case UART_LSR:
+        *val = UART_LSR_TX_IDLE;
+        break;
+    case UART_SCR:
+        *val = u->scr;
+        break;
+    default:
+        *val = 0;             // MSR, and beyond the registers
+        break;
+    }
+    return 0;
+}
+
+static int uart_write(struct proc *p, uint64 off, int size, uint64 val)
+{
+    struct vuart *u = &p->vm_state->uart;
+    bool dlab = (u->lcr & UART_LCR_DLAB) != 0;
+
+    switch (off)
+    {
+    case UART_THR:
+        if (dlab)
+        {
+            u->dll = val;
+            break;
+        }
+        u->buf[u->len++] = val;
+        if (u->len == VUARTBUF || (char)val == '\n')
+            mmio_flush(p);
+        break;
+    case UART_IER:
+        if (dlab)
+            u->dlm = val;
+        else
+            u->ier = val & 0x0F;
+        break;
+    case UART_LCR:
+        u->lcr = val;
+        break;
+    case UART_MCR:
+        u->mcr = val & 0x1F;
+        break;
+    case UART_SCR:
+        u->scr = val;
+        break;
+    default:
+        break;                // FCR, and read-only registers
+    }
+    return 0;
+}
+
+static struct mmiodev mmiodevs[] = {
+    { CLINT, 0x10000, clint_read, clint_write },
+    { UART0, PGSIZE, uart_read, uart_write },
+};
+
+// Write out the console output that the guest's virtual UART
+// has collected.
+void mmio_flush(struct proc *p)
+{
+    struct vuart *u = &p->vm_state->uart;
+
+    if (u->len > 0)
+    {
+        cons_write(p, u->buf, u->len);
+        u->len = 0;
+    }
+}
+
+// The device at guest-physical address pa, or 0 if none.
+static struct mmiodev *mmio_dev(uint64 pa)
+{
+    for (struct mmiodev *d = mmiodevs; d < &mmiodevs[NELEM(mmiodevs)]; d++)
+    {
+        if (pa >= d->base && pa < d->base + d->size)
+            return d;
+    }
+    return 0;
+}
+
+// Decode insn as a load or store into *op.
+// Returns 0 on success, -1 if it is neither.
+static int mmio_decode(uint32 insn, struct mmio_op *op)
+{
+    int funct3;
+
+    if ((insn & 0x3) == 0x3)
+    {
+        op->len = 4;
+        funct3 = (insn >> 12) & 0x7;
+        switch (insn & 0x7F)
+        {
+        case 0x03: // LB LH LW LD LBU LHU LWU
+            if (funct3 == 7)
+                return -1;
+            op->store = 0;
+            op->size = 1 << (funct3 & 3);
+            op->sext = (funct3 & 4) == 0;
+            op->reg = (insn >> 7) & 0x1F;
+            return 0;
+        case 0x23: // SB SH SW SD
+            if (funct3 > 3)
+                return -1;
+            op->store = 1;
+            op->size = 1 << funct3;
+            op->reg = (insn >> 20) & 0x1F;
+            return 0;
+        }
+        return -1;
+    }
+
+    // compressed: C.LW C.LD C.SW C.SD, and their sp-relative forms
+    op->len = 2;
+    funct3 = (insn >> 13) & 0x7;
+    if ((funct3 & 0x3) < 2 || (insn & 0x3) == 0x1)
+        return -1;
+    op->store = (funct3 & 0x4) != 0;
+    op->size = (funct3 & 0x1) ? 8 : 4;
+    op->sext = 1;
+    if ((insn & 0x3) == 0x0)
+        op->reg = 8 + ((insn >> 2) & 0x7);    // rd' or rs2'
+    else if (op->store)
+        op->reg = (insn >> 2) & 0x1F;         // rs2
+    else
+        op->reg = (insn >> 7) & 0x1F;         // rd
+    return 0;
+}
+
+// Emulate the load or store at the guest's pc, which faulted
+// with scause on register pa - d->base of device d.
+// Returns 0 if emulated, -1 if it is not a suitable access.
+static int mmio_emulate(struct proc *p, struct mmiodev *d, uint64 scause, uint64 pa)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 pc = p->trapframe->epc;
+    struct mmio_op op;
+    uint32 insn;
+    uint64 val;
+
+    if (trap_and_emulate_fetch(p, pc, &insn) < 0)
+        return -1;
+    if (mmio_decode(insn, &op) < 0 ||
+        op.store != (scause == 15) || (pa & (op.size - 1)) != 0)
+        return -1;
+
+    if (op.store)
+    {
+        if (d->write(p, pa - d->base, op.size, getreg(p, op.reg)) < 0)
+            return -1;
+    }
+    else
+    {
+        if (d->read(p, pa - d->base, op.size, &val) < 0)
+            return -1;
+        if (op.size < 8)
+        {
+            val &= (1UL << (op.size * 8)) - 1;
+            if (op.sext && (val >> (op.size * 8 - 1)))
+                val |= ~0UL << (op.size * 8);
+        }
+        setreg(p, op.reg, val);
+    }
+    vs->exits++;
+    vs->mmio++;
+    p->trapframe->epc += op.len;
+    return 0;
+}
+
+// Handle a load or store page fault scause at guest-virtual
+// address va, guest-physical address pa, in VM process p, by
+// emulating the faulting instruction if pa is a register of a
+// virtual device that the guest may access.
+// Returns 0 if emulated, -1 if there is no device there.
+int mmio_fault(struct proc *p, uint64 scause, uint64 va, uint64 pa)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    int acc = scause == 15 ? PTE_W : PTE_R;
+    struct mmiodev *d;
+
+    if (vs == 0 || scause == 12)
+        return -1;
+    if ((d = mmio_dev(pa)) == 0)
+        return -1;
+    if ((pmp_access(p, pa) & acc) == 0)
+        return -1;
+    if (mmio_emulate(p, d, scause, pa) < 0)
+        return -1;
+
+    // until the guest's view of memory changes, the page
+    // table in use maps va to pa, and the guest may access
+    // it as it just did.
+    if (vs->mmio_pagetable != p->pagetable || vs->mmio_va != PGROUNDDOWN(va) ||
+        vs->mmio_pa != PGROUNDDOWN(pa))
+    {
+        vs->mmio_pagetable = p->pagetable;
+        vs->mmio_va = PGROUNDDOWN(va);
+        vs->mmio_pa = PGROUNDDOWN(pa);
+        vs->mmio_acc = 0;
+    }
+    vs->mmio_acc |= acc;
+    return 0;
+}
+
+// Handle a load or store page fault scause at guest-virtual
+// address va without a full exit, if it is on the device page
+// that mmio_fault() last handled a like access to, with the
+// same page table in use.
+// Returns 0 if emulated, -1 if it needs a full exit.
+int mmio_fast(struct proc *p, uint64 scause, uint64 va)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct mmiodev *d;
+    uint64 pa;
+
+    if (vs == 0 || (vs->mmio_acc & (scause == 15 ? PTE_W : PTE_R)) == 0 ||
+        p->pagetable != vs->mmio_pagetable || PGROUNDDOWN(va) != vs->mmio_va)
+        return -1;
+    pa = vs->mmio_pa + (va & (PGSIZE - 1));
+    if ((d = mmio_dev(pa)) == 0)
+        return -1;
+    // a store to msip or mtimecmp may raise an interrupt, which
+    // only a full exit delivers.
+    if (scause == 15 && d->base == CLINT)
+        return -1;
+    if (mmio_emulate(p, d, scause, pa) < 0)
+        return -1;
+    vs->mmiofast++;
+    return 0;
+}
@@ -12,3 +12,5 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define VMEXITBUDGET  16   // default privileged instructions emulated per VM exit
+#define VMMAXEXITBUDGET 1024 // largest budget vmctl() accepts
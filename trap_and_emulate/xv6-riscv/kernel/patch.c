@@ -0,0 +1,166 @@
+// Guest code patching.
+//
+// A guest that reads a read-only CSR, such as mhartid, in a
+// loop or on a hot path exits on every read, though the value
+// never changes. After emulating such a read, patch_csrr()
+// rewrites the csr instruction in the guest's text into code
+// that puts the same value in the same register without an
+// exit: one addi or lui when the value allows it, else, for
+// M-mode code, a jal to a stub that loads the value from the
+// VM's stub page and jumps back.
+//
+// Only sites that the guest executes with translation off are
+// patched, so that the guest address of the instruction is its
+// guest-physical address. Pages that the VM shares with a
+// template are copied first, so that its clones keep their own
+// text. vmctl(VMCTL_PATCH, 0) turns patching off for a VM, and
+// VMs with several vCPUs are never patched.
+//
+// The decode cache entry for a patched site is left alone: the
+// guest no longer traps there, and a store that puts a csr
+// instruction back goes through the write protection that
+// keeps the cache coherent.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+// A stub: auipc rd, 0; ld rd, 16(rd); jal x0, back; nop; then
+// the value, 8-byte aligned as every stub starts at a multiple
+// of STUBSIZE.
+#define STUBSIZE 24
+
+#define INSN_NOP 0x00000013 // addi x0, x0, 0
+
+static uint32 insn_addi(int rd, long imm)
+{
+    return ((uint32)(imm & 0xFFF) << 20) | (rd << 7) | 0x13;
+}
+
+static uint32 insn_lui(int rd, uint64 val)
+{
+    return (uint32)(val & 0xFFFFF000) | (rd << 7) | 0x37;
+}
+
+static uint32 insn_auipc(int rd)
+{
+    return (rd << 7) | 0x17;
+}
+
+static uint32 insn_ld(int rd, int rs1, int off)
+{
+    return ((uint32)(off & 0xFFF) << 20) | (rs1 << 15) | (3 << 12) | (rd << 7) | 0x03;
+}
+
+// jal x0 to off bytes from the jal, which must be within 1MB.
+static uint32 insn_j(long off)
+{
+    return (((off >> 20) & 0x1) << 31) | (((off >> 1) & 0x3FF) << 21) |
+           (((off >> 11) & 0x1) << 20) | (((off >> 12) & 0xFF) << 12) | 0x6F;
+}
+
+static bool jal_reaches(long off)
+{
+    return off >= -(1L << 20) && off < (1L << 20);
+}
+
+// The one instruction that sets rd to val, or 0 if none does.
+static uint32 li_insn(int rd, uint64 val)
+{
+    if (rd == 0)
+        return INSN_NOP;
+    if ((long)val >= -2048 && (long)val < 2048)
+        return insn_addi(rd, val);
+    if ((val & 0xFFF) == 0 && (long)val == (int)val)
+        return insn_lui(rd, val);
+    return 0;
+}
+
+// Add a stub that sets rd to val and returns to the instruction
+// after the one at pc, mapping the VM's stub page just past its
+// image the first time. Returns the stub's guest-physical
+// address, or 0 if out of room, out of reach, or out of memory.
+static uint64 stub_add(struct proc *p, uint64 pc, int rd, uint64 val)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 stub;
+    uint32 code[4];
+    char *mem;
+
+    if (vs->stub == 0)
+    {
+        stub = PGROUNDUP(p->sz);
+        if (stub >= VMRAMBASE || walkaddr(vs->og_pagetable, stub) != 0)
+            return 0;
+        if ((mem = kalloc()) == 0)
+            return 0;
+        memset(mem, 0, PGSIZE);
+        if (mappages(vs->og_pagetable, stub, PGSIZE, (uint64)mem, PTE_R | PTE_X | PTE_U) < 0)
+        {
+            kfree(mem);
+            return 0;
+        }
+        vs->stub = stub;
+    }
+    if (vs->stub_used + STUBSIZE > PGSIZE)
+        return 0;
+    stub = vs->stub + vs->stub_used;
+    if (!jal_reaches(stub - pc) || !jal_reaches(pc + 4 - (stub + 8)))
+        return 0;
+    if ((mem = vmmem_private(p, vs->stub)) == 0)
+        return 0;
+
+    code[0] = insn_auipc(rd);
+    code[1] = insn_ld(rd, rd, 16);
+    code[2] = insn_j(pc + 4 - (stub + 8));
+    code[3] = INSN_NOP;
+    mem += vs->stub_used;
+    memmove(mem, code, sizeof(code));
+    memmove(mem + sizeof(code), &val, sizeof(val));
+    vs->stub_used += STUBSIZE;
+    return stub;
+}
+
+// The guest's 4-byte csr instruction at pc just read val, which
+// it will always read there, into rd: rewrite it so that the
+// guest gets val without an exit.
+void patch_csrr(struct proc *p, uint64 pc, int rd, uint64 val)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 stub;
+    uint32 insn;
+    char *text;
+
+    // the vCPUs of a VM share its text, but not mhartid, nor
+    // a way to make the other harts fetch the new instruction.
+    if (p->vmcfg.nopatch || vs->group)
+        return;
+    // with translation on, pc is not a guest-physical address.
+    if (vs->priviledge_mode != M_MODE && (vs->csr[VCSR_SATP] >> 60) != 0)
+        return;
+    if ((pc & (PGSIZE - 1)) > PGSIZE - 4)
+        return;
+
+    if ((insn = li_insn(rd, val)) == 0)
+    {
+        // a stub page is only reachable with translation off in
+        // every mode, and S- and U-mode may turn theirs on.
+        if (vs->priviledge_mode != M_MODE || (stub = stub_add(p, pc, rd, val)) == 0)
+            return;
+        insn = insn_j(stub - pc);
+    }
+
+    if ((text = vmmem_private(p, pc)) == 0)
+        return;
+    memmove(text + (pc & (PGSIZE - 1)), &insn, sizeof(insn));
+    fence_i();
+    vs->patched++;
+}
@@ -0,0 +1,213 @@
+// Physical memory protection for VMs.
+//
+// Once the guest has configured PMP, its S- and U-mode accesses
+// to guest-physical memory go through a PMP-restricted copy of
+// the VM's base page table, in vs->pmp_pagetable. The copy is
+// built once, by pmp_pagetable(), at the first switch to S- or
+// U-mode after a pmpcfg or pmpaddr write; after that a privilege
+// transition only swaps the root in p->pagetable.
+//
+// PMP works at 4-byte granularity, but the host maps whole pages,
+// so a page that an entry matches only in part is inaccessible.
+// Until the guest writes a PMP register, S- and U-mode may access
+// all of guest-physical memory, as if firmware had granted it.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+#define NPMP 64
+
+#define PMP_R      0x01
+#define PMP_W      0x02
+#define PMP_X      0x04
+#define PMP_A      0x18 // address matching mode
+#define PMP_OFF    0x00
+#define PMP_TOR    0x08
+#define PMP_NA4    0x10
+#define PMP_NAPOT  0x18
+
+// The access that PMP grants S- and U-mode to the guest-physical
+// page at pa, as PTE_R, PTE_W and PTE_X bits: that of the lowest
+// numbered entry matching any of the page, if it matches all of it.
+static int pmp_perm(struct vm_virtual_state *vs, uint64 pa)
+{
+    uint64 cfg, addr, lo, hi, prev = 0;
+    int t;
+
+    for (int i = 0; i < NPMP; i++)
+    {
+        // on RV64, even-numbered pmpcfg registers hold 8 entries each
+        cfg = (vs->csr[VCSR_PMPCFG0 + (i / 8) * 2] >> ((i % 8) * 8)) & 0xFF;
+        addr = vs->csr[VCSR_PMPADDR0 + i];
+
+        switch (cfg & PMP_A)
+        {
+        case PMP_TOR:
+            lo = prev << 2;
+            hi = addr << 2;
+            break;
+        case PMP_NA4:
+            lo = addr << 2;
+            hi = lo + 4;
+            break;
+        case PMP_NAPOT:
+            for (t = 0; t < 54 && (addr >> t) & 1; t++)
+                ;
+            lo = (addr & ~((1UL << t) - 1)) << 2;
+            hi = lo + (1UL << (t + 3));
+            break;
+        default:
+            prev = addr;
+            continue;
+        }
+        prev = addr;
+
+        if (lo >= hi || hi <= pa || lo >= pa + PGSIZE)
+            continue; // no match
+        if (lo > pa || hi < pa + PGSIZE)
+            return 0; // matches only part of the page
+        if ((cfg & (PMP_R | PMP_W)) == PMP_W)
+            return 0; // reserved
+        return (cfg & (PMP_R | PMP_W | PMP_X)) << 1;
+    }
+    return 0;
+}
+
+// Map page va into pt, as the base page table maps it with pte
+// but with the permissions that PMP leaves it.
+// Returns 0 on success, -1 if out of memory.
+static int pmp_leaf(struct vm_virtual_state *vs, pagetable_t pt, uint64 va, pte_t pte)
+{
+    pte_t *npte;
+    uint64 flags;
+    int perm;
+
+    if ((pte & PTE_U) == 0 || (perm = pmp_perm(vs, va)) == 0)
+        return 0;
+
+    // keep pages write-protected by the decode cache protected.
+    flags = PTE_FLAGS(pte) & ~(PTE_R | PTE_W | PTE_X | PTE_WP);
+    flags |= pte & perm & (PTE_R | PTE_X);
+    if (perm & PTE_W)
+        flags |= pte & (PTE_W | PTE_WP);
+    if ((npte = walk(pt, va, 1)) == 0)
+        return -1;
+    *npte = PA2PTE(PTE2PA(pte)) | flags;
+    return 0;
+}
+
+// Map into pt each page of the base page table subtree tbl,
+// which maps addresses from va at level, with pmp_leaf().
+// Returns 0 on success, -1 if out of memory.
+static int pmp_fill(struct vm_virtual_state *vs, pagetable_t pt,
+                    pagetable_t tbl, int level, uint64 va)
+{
+    pte_t pte;
+    uint64 a;
+
+    for (int i = 0; i < 512; i++)
+    {
+        pte = tbl[i];
+        a = va + ((uint64)i << PXSHIFT(level));
+        if ((pte & PTE_V) == 0)
+            continue;
+        if ((pte & (PTE_R | PTE_W | PTE_X)) == 0)
+        {
+            // this PTE points to a lower-level page table.
+            if (pmp_fill(vs, pt, (pagetable_t)PTE2PA(pte), level - 1, a) < 0)
+                return -1;
+            continue;
+        }
+        if (pmp_leaf(vs, pt, a, pte) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// The page table for the guest's S- and U-mode accesses to
+// guest-physical memory: the base table if the guest has not
+// configured PMP, else the PMP-restricted copy, rebuilt first
+// if PMP has changed. Returns 0 if out of memory.
+pagetable_t pmp_pagetable(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (!vs->pmp_setup)
+        return vs->og_pagetable;
+    if (vs->pmp_pagetable && !vs->pmp_dirty)
+        return vs->pmp_pagetable;
+
+    pmp_free(p);
+    // proc_pagetable() maps the trampoline and trapframe.
+    if ((vs->pmp_pagetable = proc_pagetable(p)) == 0)
+        return 0;
+    if (pmp_fill(vs, vs->pmp_pagetable, vs->og_pagetable, 2, 0) < 0)
+    {
+        pmp_free(p);
+        return 0;
+    }
+    vs->pmp_dirty = false;
+    return vs->pmp_pagetable;
+}
+
+// The base page table has a new page at va: map it in the
+// PMP-restricted table too, unless that is yet to be rebuilt.
+// Returns 0 on success, -1 if out of memory.
+int pmp_map(struct proc *p, uint64 va)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    pte_t *pte;
+
+    if (vs->pmp_pagetable == 0 || vs->pmp_dirty)
+        return 0;
+    if ((pte = walk(vs->og_pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+        return 0;
+    return pmp_leaf(vs, vs->pmp_pagetable, va, *pte);
+}
+
+// The access, as PTE_R, PTE_W and PTE_X bits, that the guest
+// in its current mode has to the page holding guest-physical
+// address pa: all of it in M-mode, or before PMP is configured.
+int pmp_access(struct proc *p, uint64 pa)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (vs->priviledge_mode == M_MODE || !vs->pmp_setup)
+        return PTE_R | PTE_W | PTE_X;
+    return pmp_perm(vs, PGROUNDDOWN(pa));
+}
+
+// The guest wrote a PMP register. Its S- and U-mode accesses
+// need a new PMP-restricted table, and so do shadows built
+// on the old one.
+void pmp_changed(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    vs->pmp_setup = true;
+    vs->pmp_dirty = true;
+    vs->mmio_acc = 0;
+    shadow_flush(p);
+}
+
+// Free the PMP-restricted page table. If it is in use, go
+// back to the base table.
+void pmp_free(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (p->pagetable == vs->pmp_pagetable)
+        p->pagetable = vs->og_pagetable;
+    if (vs->pmp_pagetable)
+        uvmfreetable(vs->pmp_pagetable);
+    vs->pmp_pagetable = 0;
+}
@@ -124,6 +124,9 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  // CSE 536: default VM settings, which fork() replaces.
+  memset(&p->vmcfg, 0, sizeof(p->vmcfg));
+  p->vmcfg.consfd = -1;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -155,12 +158,16 @@ found:
 static void
 freeproc(struct proc *p)
 {
-  if (strncmp(p->name, "vm-", 3) == 0) {
-    // CSE 536: Also unmap the VM memory region
-    uint64 memaddr_start = 0x80000000;
-    uint64 memaddr_count = 1024;
-    uvmunmap(p->pagetable, memaddr_start, memaddr_count, 0);
+  // CSE 536: free the VM's RAM, unless other vCPUs of the VM
+  // still use it, and its state, which also puts back the VM's
+  // base page table.
+  if (p->proc_te_vm){
+    if(vcpu_free(p))
+      p->sz = 0;  // the image is the other vCPUs' too
+    else
+      vmmem_free(p);
   }
+  trap_and_emulate_vmfree(p);
 
   if(p->trapframe)
     kfree((void*)p->trapframe);
@@ -175,6 +182,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->proc_te_vm = 0;
   p->state = UNUSED;
 }
 
@@ -316,6 +324,156 @@ fork(void)
   np->cwd = idup(p->cwd);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
+  np->vmcfg = p->vmcfg;
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
+// CSE 536: create a new VM process, a child of the caller
+// like one from fork(), from VM template slot; see vmmem.c.
+// Returns the new process's pid, or -1.
+int
+vmclone(int slot)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+
+  // Share the template's memory, and copy its registers
+  // and virtual CPU state.
+  if(vmmem_clone(np, slot) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  // start it on the page table for the guest's mode.
+  shadow_switch(np);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
+// CSE 536: start a new VM, a child of the caller, from the
+// checkpoint in the file open as fd; see vmckpt.c.
+// Returns the new process's pid, or -1.
+int
+vmrestore(int fd)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct vmckpt *ck;
+
+  // Read the checkpoint's header and index.
+  if((ck = vmckpt_open(fd)) == 0)
+    return -1;
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    vmckpt_close(ck);
+    return -1;
+  }
+
+  // Copy its registers and virtual CPU state; its memory
+  // stays in the file until the VM touches it.
+  if(vmckpt_restore(np, ck) < 0){
+    freeproc(np);
+    release(&np->lock);
+    vmckpt_close(ck);
+    return -1;
+  }
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  // start it on the page table for the guest's mode.
+  shadow_switch(np);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  np->state = RUNNABLE;
+  release(&np->lock);
+
+  return pid;
+}
+
+// CSE 536: create vCPU hartid of VM process p, a child of p
+// that shares its memory and starts where p did; see vcpu.c.
+// Returns the new process's pid, or -1.
+int
+vcpufork(struct proc *p, int hartid)
+{
+  int i, pid;
+  struct proc *np;
+
+  // Allocate process.
+  if((np = allocproc()) == 0){
+    return -1;
+  }
+
+  // Its own virtual CPU state, then the VM's memory.
+  if(trap_and_emulate_vcpu(np, p->vm_state, hartid) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  vcpu_share(np, p, hartid);
+  np->sz = p->sz;
+  *(np->trapframe) = *(p->trapframe);
+  np->proc_te_vm = 1;
+  np->vmcfg = p->vmcfg;
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  // increment reference counts on open file descriptors.
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
 
   pid = np->pid;
 
@@ -372,6 +530,9 @@ exit(int status)
   end_op();
   p->cwd = 0;
 
+  // a VM's checkpoint file, which it may still read pages from.
+  vmckpt_exit(p);
+
   acquire(&wait_lock);
 
   // Give any children to init.
@@ -43,7 +43,7 @@ extern struct cpu cpus[NCPU];
 struct trapframe {
   /*   0 */ uint64 kernel_satp;   // kernel page table
   /*   8 */ uint64 kernel_sp;     // top of process's kernel stack
-  /*  16 */ uint64 kernel_trap;   // usertrap()
+  /*  16 */ uint64 kernel_trap;   // usertrap(), or vmtrap() for VMs
   /*  24 */ uint64 epc;           // saved user program counter
   /*  32 */ uint64 kernel_hartid; // saved kernel tp
   /*  40 */ uint64 ra;
@@ -79,6 +79,18 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// CSE 536: VM settings, changed with vmctl(). Inherited by
+// fork() and kept across exec(), so that a launcher can
+// configure the guests it starts. Zero means the default.
+struct vmconfig {
+  int exitbudget;              // privileged instructions emulated per exit
+  int trace;                   // trace verbosity, VMTRACE_*
+  uint64 memsize;              // guest RAM in bytes, VMCTL_MEMSIZE
+  int consfd;                  // fd for guest console output, -1 for the console
+  int nopatch;                 // do not patch guest text, VMCTL_PATCH
+  int ncpu;                    // vCPUs, VMCTL_NCPU; 0 for one
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -105,6 +117,8 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
 
-  // CSE 536: track that this is a VM and ecall must be handled differently
+  // CSE 536: set by exec() for vm-* images, whose traps go to vmtrap()
   int proc_te_vm;
+  struct vm_virtual_state *vm_state; // Virtual CPU state if proc_te_vm
+  struct vmconfig vmcfg;       // VM settings, see vmctl()
 };
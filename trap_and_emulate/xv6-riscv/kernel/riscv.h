@@ -16,6 +16,9 @@ r_mhartid()
 #define MSTATUS_MPP_S (1L << 11)
 #define MSTATUS_MPP_U (0L << 11)
 #define MSTATUS_MIE (1L << 3)    // machine-mode interrupt enable.
+#define MSTATUS_MPIE (1L << 7)   // machine previous interrupt enable.
+#define MSTATUS_TVM (1L << 20)   // trap satp and sfence.vma in S-mode.
+#define MSTATUS_TW (1L << 21)    // trap wfi in S-mode.
 
 static inline uint64
 r_mstatus()
@@ -47,6 +50,8 @@ w_mepc(uint64 x)
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
 #define SSTATUS_SIE (1L << 1)  // Supervisor Interrupt Enable
 #define SSTATUS_UIE (1L << 0)  // User Interrupt Enable
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User memory
+#define SSTATUS_MXR (1L << 19) // Make eXecutable pages Readable
 
 static inline uint64
 r_sstatus()
@@ -99,6 +104,11 @@ w_sie(uint64 x)
 #define MIE_MEIE (1L << 11) // external
 #define MIE_MTIE (1L << 7)  // timer
 #define MIE_MSIE (1L << 3)  // software
+
+// Machine-mode Interrupt Pending
+#define MIP_MEIP (1L << 11) // external
+#define MIP_MTIP (1L << 7)  // timer
+#define MIP_MSIP (1L << 3)  // software
 static inline uint64
 r_mie()
 {
@@ -256,6 +266,21 @@ r_mcounteren()
   return x;
 }
 
+// Supervisor Counter-Enable
+static inline void 
+w_scounteren(uint64 x)
+{
+  asm volatile("csrw scounteren, %0" : : "r" (x));
+}
+
+static inline uint64
+r_scounteren()
+{
+  uint64 x;
+  asm volatile("csrr %0, scounteren" : "=r" (x) );
+  return x;
+}
+
 // machine-mode cycle counter
 static inline uint64
 r_time()
@@ -327,6 +352,14 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// make this hart's instruction fetches see earlier stores.
+static inline void
+fence_i()
+{
+  // fence.i, spelled out for assemblers without Zifencei.
+  asm volatile(".word 0x0000100f" : : : "memory");
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -343,6 +376,11 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_G (1L << 5) // global
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
+#define PTE_COW (1L << 8) // software: VM page shared copy-on-write
+#define PTE_WP (1L << 9) // software: write-protected by the VM decode cache
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -0,0 +1,351 @@
+// Shadow page tables, which let a guest turn on its own Sv39
+// paging while it runs in host user mode.
+//
+// Guest-physical memory is the VM's base user page table, as
+// set up by exec(), or its PMP-restricted copy (see pmp.c) once
+// the guest has configured PMP. While the guest runs in S- or U-mode with
+// satp in Sv39 mode, p->pagetable is instead a shadow page
+// table that maps guest-virtual addresses straight to the
+// host pages behind them. A shadow starts out empty and is
+// filled in one page at a time by shadow_pagefault(). Each
+// VM keeps a few shadows, keyed by guest satp (root and ASID),
+// so that a guest switching between address spaces with
+// different ASIDs does not rebuild them from scratch.
+//
+// Guest superpages are shadowed with 4K pages. Guest virtual
+// addresses in the host's trampoline and trapframe pages, or
+// above them, cannot be shadowed; a guest using them is killed.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+#define SATP_MODE(satp) ((satp) >> 60)
+#define SATP_ASID(satp) (((satp) >> 44) & 0xFFFF)
+#define SATP_PPN(satp)  ((satp) & ((1L << 44) - 1))
+
+// guest PTEs have reserved bits above the PPN.
+#define GPTE2PA(pte) ((((pte) >> 10) & ((1L << 44) - 1)) << 12)
+
+// Translate guest-virtual va through the guest's Sv39 page table
+// for an access acc (PTE_R, PTE_W or PTE_X) in the guest's
+// current mode, setting the A and D bits of the guest PTE as a
+// hart would. On success, returns the guest's leaf PTE and sets
+// *gpa to the guest-physical address of va's page and *level
+// to the level of the leaf. The guest's page table is read
+// through phys, its S- and U-mode view of guest-physical memory.
+// Returns 0 on a guest page fault.
+static pte_t guest_walk(struct proc *p, pagetable_t phys, uint64 va, int acc,
+                        uint64 *gpa, int *level)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 status = vs->csr[VCSR_SSTATUS];
+    uint64 mode = vs->priviledge_mode;
+    uint64 a = SATP_PPN(vs->csr[VCSR_SATP]) << 12;
+    uint64 pteaddr, span;
+    pte_t pte;
+
+    // bits 63:39 must all equal bit 38
+    if ((va >> 38) != 0 && (va >> 38) != (1L << 26) - 1)
+        return 0;
+
+    for (int l = 2; l >= 0; l--)
+    {
+        pteaddr = a + PX(l, va) * sizeof(pte_t);
+        if (copyin(phys, (char *)&pte, pteaddr, sizeof(pte)) < 0 &&
+            (vmmem_fault(p, pteaddr, 0) < 0 || copyin(phys, (char *)&pte, pteaddr, sizeof(pte)) < 0))
+            return 0;
+        if ((pte & PTE_V) == 0 || ((pte & PTE_R) == 0 && (pte & PTE_W)))
+            return 0;
+        if ((pte & (PTE_R | PTE_X)) == 0)
+        {
+            // this PTE points to a lower-level page table.
+            a = GPTE2PA(pte);
+            continue;
+        }
+
+        span = 1L << PXSHIFT(l);
+        if (GPTE2PA(pte) & (span - 1))
+            return 0; // misaligned superpage
+
+        if (mode == U_MODE && (pte & PTE_U) == 0)
+            return 0;
+        if (mode == S_MODE && (pte & PTE_U) &&
+            (acc == PTE_X || (status & SSTATUS_SUM) == 0))
+            return 0;
+        if (acc == PTE_R)
+        {
+            if ((pte & PTE_R) == 0 && !((status & SSTATUS_MXR) && (pte & PTE_X)))
+                return 0;
+        }
+        else if ((pte & acc) == 0)
+            return 0;
+
+        if ((pte & PTE_A) == 0 || (acc == PTE_W && (pte & PTE_D) == 0))
+        {
+            // copyout() would write to a page shared copy-on-write.
+            pte_t *bpte = walk(phys, pteaddr, 0);
+            pte |= PTE_A | (acc == PTE_W ? PTE_D : 0);
+            if ((bpte && (*bpte & PTE_COW) && vmmem_fault(p, pteaddr, 1) < 0) ||
+                copyout(phys, pteaddr, (char *)&pte, sizeof(pte)) < 0)
+                return 0;
+        }
+
+        *gpa = GPTE2PA(pte) + (va & (span - 1) & ~(PGSIZE - 1));
+        *level = l;
+        return pte;
+    }
+    return 0;
+}
+
+// Free shadow sh. If it is in use, go back to the base table;
+// shadow_switch() picks the right one afterwards.
+static void shadow_free(struct proc *p, struct shadow *sh)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (vs->shadow_cur == sh)
+    {
+        p->pagetable = vs->og_pagetable;
+        vs->shadow_cur = 0;
+    }
+    vs->mmio_acc = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (sh->root[i])
+            uvmfreetable(sh->root[i]);
+    }
+    memset(sh, 0, sizeof(*sh));
+}
+
+// Find the shadow of guest satp, or make an empty one in
+// place of the least recently used. Returns 0 if out of memory.
+static struct shadow* shadow_get(struct proc *p, uint64 satp)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct shadow *sh, *victim = vs->shadow;
+
+    for (sh = vs->shadow; sh < &vs->shadow[NSHADOW]; sh++)
+    {
+        if (sh->satp == satp)
+            return sh;
+        if (sh->used < victim->used)
+            victim = sh;
+    }
+
+    shadow_free(p, victim);
+    // proc_pagetable() maps the trampoline and trapframe.
+    if ((victim->root[0] = proc_pagetable(p)) == 0 ||
+        (victim->root[1] = proc_pagetable(p)) == 0)
+    {
+        shadow_free(p, victim);
+        return 0;
+    }
+    victim->satp = satp;
+    return victim;
+}
+
+// Free all of p's shadows and go back to its base page table.
+// Called when the shadows' contents may all be stale, and
+// when the VM is torn down.
+void shadow_flush(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    for (struct shadow *sh = vs->shadow; sh < &vs->shadow[NSHADOW]; sh++)
+        shadow_free(p, sh);
+}
+
+// Point p->pagetable at the right page table for the guest's
+// current privilege mode and satp: the base table in M-mode,
+// the PMP-restricted table if its paging is off, else a shadow
+// of its page table. Called after anything that may change either.
+void shadow_switch(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 satp = vs->csr[VCSR_SATP];
+    uint64 status = vs->csr[VCSR_SSTATUS] & (SSTATUS_SUM | SSTATUS_MXR);
+    struct shadow *sh;
+    pagetable_t phys;
+
+    if (status != vs->shadow_status)
+    {
+        // shadow permissions depend on SUM and MXR.
+        shadow_flush(p);
+        vs->shadow_status = status;
+    }
+
+    sh = vs->shadow_cur;
+    phys = vs->og_pagetable;
+    if (vs->priviledge_mode != M_MODE && (phys = pmp_pagetable(p)) == 0)
+    {
+        printf("pmp: out of memory\n");
+        setkilled(p);
+        return;
+    }
+    if (vs->priviledge_mode == M_MODE || SATP_MODE(satp) != 8)
+    {
+        if (sh)
+        {
+            vs->shadow_cur = 0;
+            trap_and_emulate_flush(p);
+        }
+        p->pagetable = phys;
+        return;
+    }
+
+    if (sh == 0 || sh->satp != satp)
+    {
+        if ((sh = shadow_get(p, satp)) == 0)
+        {
+            printf("shadow: out of memory\n");
+            setkilled(p);
+            return;
+        }
+        vs->shadow_cur = sh;
+        trap_and_emulate_flush(p); // the decode cache is by guest-virtual pc
+    }
+    sh->used = ++vs->shadow_clock;
+    p->pagetable = sh->root[vs->priviledge_mode == U_MODE];
+}
+
+// Handle page fault scause at guest-virtual address va in
+// VM process p. While the guest's paging is on, either map
+// va in the shadow, or deliver the fault to the guest; while
+// it is off, va is guest-physical, and the fault can only be
+// a first touch of RAM, or an access to a virtual device.
+// Returns 0 if handled, -1 if p should be killed.
+int shadow_pagefault(struct proc *p, uint64 scause, uint64 va)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct shadow *sh;
+    pagetable_t phys;
+    pte_t gpte, *bpte, *spte;
+    uint64 gpa, perm;
+    int acc, level;
+
+    if (vs == 0)
+        return -1;
+    if ((sh = vs->shadow_cur) == 0)
+        return vmmem_fault(p, va, scause == 15) == 0 ? 0 : mmio_fault(p, scause, va, va);
+    if ((phys = pmp_pagetable(p)) == 0)
+    {
+        printf("pmp: out of memory\n");
+        return -1;
+    }
+    acc = scause == 12 ? PTE_X : scause == 13 ? PTE_R : PTE_W;
+
+    if ((gpte = guest_walk(p, phys, va, acc, &gpa, &level)) == 0)
+    {
+        trap_and_emulate_raise(p, scause, va);
+        return 0;
+    }
+    if (va >= TRAPFRAME)
+    {
+        printf("shadow: cannot map guest address %p\n", va);
+        return -1;
+    }
+
+    bpte = gpa < MAXVA ? walk(phys, gpa, 0) : 0;
+    if ((bpte == 0 || (*bpte & PTE_V) == 0) && vmmem_fault(p, gpa, 0) == 0)
+        bpte = walk(phys, gpa, 0); // RAM the guest had not touched yet
+    if (bpte && (*bpte & PTE_COW))
+    {
+        // shadows never map pages shared with a template: the
+        // copy would not reach them.
+        if (vmmem_fault(p, gpa, 1) < 0)
+            return -1;
+        bpte = walk(phys, gpa, 0);
+    }
+    if (bpte == 0 || (*bpte & (PTE_V | PTE_U)) != (PTE_V | PTE_U))
+    {
+        // no guest-physical memory there: a virtual device,
+        // or an access fault.
+        if (mmio_fault(p, scause, va, gpa + (va & (PGSIZE - 1))) < 0)
+            trap_and_emulate_raise(p, scause == 12 ? 1 : scause == 13 ? 5 : 7, va);
+        return 0;
+    }
+
+    // Map the page with the guest's permissions, less those of the
+    // guest-physical memory. Leave out W until the guest PTE is
+    // dirty, so that the first store comes here to set D. Pages the
+    // decode cache write-protected stay protected.
+    perm = PTE_U;
+    if ((gpte & PTE_R) || ((vs->shadow_status & SSTATUS_MXR) && (gpte & PTE_X)))
+        perm |= PTE_R;
+    if ((gpte & PTE_X) && !(vs->priviledge_mode == S_MODE && (gpte & PTE_U)))
+        perm |= PTE_X;
+    if ((gpte & PTE_W) && (gpte & PTE_D))
+        perm |= (*bpte & PTE_WP) ? PTE_WP : PTE_W;
+    perm &= *bpte | PTE_U | PTE_WP;
+    if ((perm & acc) == 0 && !(acc == PTE_W && (perm & PTE_WP)))
+    {
+        trap_and_emulate_raise(p, scause == 12 ? 1 : scause == 13 ? 5 : 7, va);
+        return 0;
+    }
+
+    if ((spte = walk(sh->root[vs->priviledge_mode == U_MODE], va, 1)) == 0)
+    {
+        printf("shadow: out of memory\n");
+        return -1;
+    }
+    *spte = PA2PTE(PTE2PA(*bpte)) | perm | PTE_V;
+    if (level > 0)
+        sh->superpages = true;
+    return 0;
+}
+
+// Translate guest-virtual va, which the guest just accessed
+// with acc, through the guest page table of p's current shadow.
+// Returns 0 and sets *gpa to the guest-physical address of va's
+// page, or returns -1 if the guest does not map it.
+int shadow_gpa(struct proc *p, uint64 va, int acc, uint64 *gpa)
+{
+    pagetable_t phys;
+    int level;
+
+    if (p->vm_state->shadow_cur == 0 || (phys = pmp_pagetable(p)) == 0)
+        return -1;
+    if (guest_walk(p, phys, va, acc, gpa, &level) == 0)
+        return -1;
+    return 0;
+}
+
+// Emulate SFENCE.VMA: drop the shadow mappings of guest-virtual
+// va, or all addresses if allva, in the shadows of address
+// space asid, or all of them if allasid. Mappings of a guest
+// superpage may be anywhere in the shadow, so a shadow that
+// has any is dropped whole.
+void shadow_sfence(struct proc *p, uint64 va, uint64 asid, int allva, int allasid)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    pte_t *pte;
+
+    for (struct shadow *sh = vs->shadow; sh < &vs->shadow[NSHADOW]; sh++)
+    {
+        if (sh->satp == 0 || (!allasid && SATP_ASID(sh->satp) != asid))
+            continue;
+        if (allva || sh->superpages)
+        {
+            shadow_free(p, sh);
+            continue;
+        }
+        if (va >= TRAPFRAME)
+            continue; // never mapped
+        for (int i = 0; i < 2; i++)
+        {
+            if ((pte = walk(sh->root[i], va, 0)) != 0)
+                *pte = 0;
+        }
+    }
+    vs->mmio_acc = 0;
+    trap_and_emulate_flush(p);
+}
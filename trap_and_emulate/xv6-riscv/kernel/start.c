@@ -17,7 +17,7 @@ void timerinit();
 __attribute__ ((aligned (16))) char stack0[STSIZE * NCPU];
 
 // a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+uint64 timer_scratch[NCPU][9];
 
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
@@ -48,6 +48,13 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor mode read the time CSR, which the
+  // hypervisor uses to time VM exits.
+  w_mcounteren(r_mcounteren() | 0x2);
+  // and user mode, so that guests can time themselves with
+  // rdtime without an exit.
+  w_scounteren(r_scounteren() | 0x2);
+
   // ask for clock interrupts.
   timerinit();
 
@@ -114,9 +121,17 @@ timerinit()
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
   // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[5] : address of CLINT MTIME register.
+  // scratch[6] : time of the next periodic timer interrupt.
+  // scratch[7] : one-shot deadline set by timerarm(), or -1.
+  // scratch[8] : set when a periodic interrupt is due, for devintr().
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
+  scratch[5] = CLINT_MTIME;
+  scratch[6] = *(uint64*)CLINT_MTIMECMP(id);
+  scratch[7] = -1;
+  scratch[8] = 0;
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
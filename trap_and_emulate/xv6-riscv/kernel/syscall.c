@@ -101,6 +101,15 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_vminfo(void);
+extern uint64 sys_vmctl(void);
+extern uint64 sys_vmtrace(void);
+extern uint64 sys_vmsnapshot(void);
+extern uint64 sys_vmclone(void);
+extern uint64 sys_vmstat(void);
+extern uint64 sys_vmmerge(void);
+extern uint64 sys_vmcheckpoint(void);
+extern uint64 sys_vmrestore(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,6 +135,15 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_vminfo]  sys_vminfo,
+[SYS_vmctl]   sys_vmctl,
+[SYS_vmtrace] sys_vmtrace,
+[SYS_vmsnapshot] sys_vmsnapshot,
+[SYS_vmclone] sys_vmclone,
+[SYS_vmstat]  sys_vmstat,
+[SYS_vmmerge] sys_vmmerge,
+[SYS_vmcheckpoint] sys_vmcheckpoint,
+[SYS_vmrestore] sys_vmrestore,
 };
 
 void
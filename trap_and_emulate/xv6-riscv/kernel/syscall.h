@@ -20,3 +20,12 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_vminfo 22
+#define SYS_vmctl  23
+#define SYS_vmtrace 24
+#define SYS_vmsnapshot 25
+#define SYS_vmclone 26
+#define SYS_vmstat 27
+#define SYS_vmmerge 28
+#define SYS_vmcheckpoint 29
+#define SYS_vmrestore 30
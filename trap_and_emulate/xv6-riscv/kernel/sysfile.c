@@ -230,6 +230,8 @@ sys_unlink(void)
 
   ip->nlink--;
   iupdate(ip);
+  if(ip->vmimage)
+    vmimage_forget(ip);  // CSE 536: let the file go
   iunlockput(ip);
 
   end_op();
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "vminfo.h"
 
 uint64
 sys_exit(void)
@@ -89,3 +90,118 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// return trap-and-emulate counters for VM process pid,
+// or system-wide totals if pid is 0.
+uint64
+sys_vminfo(void)
+{
+  int pid;
+  uint64 addr;
+  struct vminfo vi;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if(trap_and_emulate_info(pid, &vi) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char *)&vi, sizeof(vi)) < 0)
+    return -1;
+  return 0;
+}
+
+// change a VM setting of a process, or of the caller if pid is 0.
+uint64
+sys_vmctl(void)
+{
+  int pid, op;
+  uint64 val;
+
+  argint(0, &pid);
+  argint(1, &op);
+  argaddr(2, &val);
+  return trap_and_emulate_ctl(pid, op, val);
+}
+
+// drain up to n records from the trace ring of VM process pid.
+uint64
+sys_vmtrace(void)
+{
+  int pid, n;
+  uint64 addr;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  argint(2, &n);
+  if(n < 0)
+    return -1;
+  return trap_and_emulate_trace(pid, addr, n);
+}
+
+// freeze VM process pid as template slot, replacing what was
+// there, or just empty the slot if pid is 0.
+uint64
+sys_vmsnapshot(void)
+{
+  int pid, slot;
+
+  argint(0, &pid);
+  argint(1, &slot);
+  return vmmem_snapshot(pid, slot);
+}
+
+// exit statistics of VM process pid, or of all VMs if pid is 0.
+uint64
+sys_vmstat(void)
+{
+  int pid;
+  uint64 addr;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  return trap_and_emulate_stat(pid, addr);
+}
+
+// start a new VM, a child of the caller, from template slot.
+uint64
+sys_vmclone(void)
+{
+  int slot;
+
+  argint(0, &slot);
+  return vmclone(slot);
+}
+
+// scan n pages of VM memory for identical pages to merge, and
+// copy the merging statistics to addr, if not 0.
+uint64
+sys_vmmerge(void)
+{
+  int n;
+  uint64 addr;
+
+  argint(0, &n);
+  argaddr(1, &addr);
+  return vmmerge_scan(n, addr);
+}
+
+// checkpoint VM process pid to the file open as fd.
+uint64
+sys_vmcheckpoint(void)
+{
+  int pid, fd;
+
+  argint(0, &pid);
+  argint(1, &fd);
+  return vmckpt_save(pid, fd);
+}
+
+// start a new VM, a child of the caller, from the checkpoint
+// in the file open as fd.
+uint64
+sys_vmrestore(void)
+{
+  int fd;
+
+  argint(0, &fd);
+  return vmrestore(fd);
+}
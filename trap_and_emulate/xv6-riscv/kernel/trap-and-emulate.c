@@ -8,559 +8,1485 @@
 #include "csr_constants.h"
 
 #include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+#include "hypercall.h"
+
+extern struct proc proc[NPROC];
+
+// VMs halted in wfi sleep on this.
+struct spinlock vmidle;
+
+// Counters of VMs that have already exited, so that
+// system-wide totals in vminfo() survive their teardown.
+struct {
+  struct spinlock lock;
+  int nvm;
+  uint64 exits;
+  uint64 emulated;
+  uint64 dcache_hits;
+  uint64 dcache_misses;
+  uint64 batched;
+  uint64 cycles;
+  uint64 tracedropped;
+  uint64 mmio;
+  uint64 mmiofast;
+  uint64 injected;
+  uint64 wfi;
+  uint64 polled;
+  uint64 halted;
+  uint64 ramfaults;
+  uint64 cowfaults;
+  uint64 hypercalls;
+  uint64 consbytes;
+  uint64 patched;
+  uint64 imageshared;
+  uint64 ballooned;
+  uint64 ckptloads;
+  struct vm_stats stats;
+  uint64 stattime;
+} vmtotals;
+
+// CSR descriptor, one per address in the 12-bit CSR space,
+// so that decoding a csr instruction to its storage, privilege
+// check and write rules is a single indexed load.
+struct csrdesc
+{
+    uint64 wmask;  // writable (WARL) bits; others keep their value
+    ushort slot;   // index into vm_virtual_state.csr[], VCSR_NONE if absent
+    uchar priv;    // lowest privilege mode allowed to access it
+    uchar flags;   // CSRF_*
+};
+
+#define CSRF_RO     0x1 // read-only: writes are illegal instructions
+#define CSRF_PMP    0x2 // write hook: PMP configuration changed
+#define CSRF_SATP   0x4 // write hook: satp mode is WARL; trapped by mstatus.TVM
 
-#define M_MODE 2
-#define S_MODE 1
-#define U_MODE 0
+struct csrdesc csrtab[4096];
 
-// Struct to keep VM registers (Sample; feel free to change.)
-struct vm_reg
+#define ALLBITS (~0UL)
+
+// Compact description of the implemented CSRs, expanded
+// into csrtab[] by trap_and_emulate_init().
+static struct
 {
-    int code;
-    int mode; // using this variable for tracking mode
-              //  0 -> Machine Mode, 1-> Supervisor Mode, 2-> User Mode
-    uint64 val;
+    ushort csr;
+    ushort slot;
+    uchar priv;
+    uchar flags;
+    uint64 wmask;
+} csrspec[] = {
+    // User trap setup and handling
+    { CSR_USTATUS,    VCSR_USTATUS,    U_MODE, 0, 0x11 },
+    { CSR_UIE,        VCSR_UIE,        U_MODE, 0, 0x111 },
+    { CSR_UTVEC,      VCSR_UTVEC,      U_MODE, 0, ~0x2UL },
+    { CSR_USCRATCH,   VCSR_USCRATCH,   U_MODE, 0, ALLBITS },
+    { CSR_UEPC,       VCSR_UEPC,       U_MODE, 0, ~0x1UL },
+    { CSR_UCAUSE,     VCSR_UCAUSE,     U_MODE, 0, ALLBITS },
+    { CSR_UTVAL,      VCSR_UTVAL,      U_MODE, 0, ALLBITS },
+    { CSR_UIP,        VCSR_UIP,        U_MODE, 0, 0x1 },
+
+    // Supervisor trap setup and handling
+    // sstatus: UIE SIE UPIE SPIE SPP FS SUM MXR
+    { CSR_SSTATUS,    VCSR_SSTATUS,    S_MODE, 0, 0xC6133 },
+    { CSR_SEDELEG,    VCSR_SEDELEG,    S_MODE, 0, 0xB1FF },
+    { CSR_SIDELEG,    VCSR_SIDELEG,    S_MODE, 0, 0x111 },
+    { CSR_SIE,        VCSR_SIE,        S_MODE, 0, 0x333 },
+    { CSR_STVEC,      VCSR_STVEC,      S_MODE, 0, ~0x2UL },
+    { CSR_SCOUNTEREN, VCSR_SCOUNTEREN, S_MODE, 0, 0xFFFFFFFF },
+    { CSR_SSCRATCH,   VCSR_SSCRATCH,   S_MODE, 0, ALLBITS },
+    { CSR_SEPC,       VCSR_SEPC,       S_MODE, 0, ~0x1UL },
+    { CSR_SCAUSE,     VCSR_SCAUSE,     S_MODE, 0, ALLBITS },
+    { CSR_STVAL,      VCSR_STVAL,      S_MODE, 0, ALLBITS },
+    { CSR_SIP,        VCSR_SIP,        S_MODE, 0, 0x3 },
+    { CSR_SATP,       VCSR_SATP,       S_MODE, CSRF_SATP, ALLBITS },
+
+    // Machine information registers.
+    // mvendorid can be read in all privilege modes.
+    { CSR_MVENDORID,  VCSR_MVENDORID,  U_MODE, CSRF_RO, 0 },
+    { CSR_MARCHID,    VCSR_MARCHID,    M_MODE, CSRF_RO, 0 },
+    { CSR_MIMPID,     VCSR_MIMPID,     M_MODE, CSRF_RO, 0 },
+    { CSR_MHARTID,    VCSR_MHARTID,    M_MODE, CSRF_RO, 0 },
+
+    // Machine trap setup and handling
+    // mstatus: sstatus bits plus MIE MPIE MPP MPRV TVM TW TSR
+    { CSR_MSTATUS,    VCSR_MSTATUS,    M_MODE, 0, 0x7E79BB },
+    { CSR_MISA,       VCSR_MISA,       M_MODE, 0, 0 },
+    { CSR_MEDELEG,    VCSR_MEDELEG,    M_MODE, 0, 0xB3FF },
+    { CSR_MIDELEG,    VCSR_MIDELEG,    M_MODE, 0, 0x333 },
+    { CSR_MIE,        VCSR_MIE,        M_MODE, 0, 0xBBB },
+    { CSR_MTVEC,      VCSR_MTVEC,      M_MODE, 0, ~0x2UL },
+    { CSR_MCOUNTEREN, VCSR_MCOUNTEREN, M_MODE, 0, 0xFFFFFFFF },
+    { CSR_MSCRATCH,   VCSR_MSCRATCH,   M_MODE, 0, ALLBITS },
+    { CSR_MEPC,       VCSR_MEPC,       M_MODE, 0, ~0x1UL },
+    { CSR_MCAUSE,     VCSR_MCAUSE,     M_MODE, 0, ALLBITS },
+    { CSR_MTVAL,      VCSR_MTVAL,      M_MODE, 0, ALLBITS },
+    { CSR_MIP,        VCSR_MIP,        M_MODE, 0, 0x333 },
 };
 
-struct vm_virtual_state
-{
-    // User trap setup
-    struct vm_reg ustatus;
-    struct vm_reg uie;
-    struct vm_reg utvec;
-
-    // User trap handling
-    struct vm_reg uscratch;
-    struct vm_reg uepc;
-    struct vm_reg ucause;
-    struct vm_reg utval;
-    struct vm_reg uip;
-
-    // Supervisor trap setup
-    struct vm_reg sstatus;
-    struct vm_reg sedeleg;
-    struct vm_reg sideleg;
-    struct vm_reg sie;
-    struct vm_reg stvec;
-    struct vm_reg scounteren;
-
-    // Supervisor trap handling
-    struct vm_reg sscratch;
-    struct vm_reg sepc;
-    struct vm_reg scause;
-    struct vm_reg stval;
-    struct vm_reg sip;
-
-    // Supervisor page table register
-    struct vm_reg satp;
-
-    // Machine information registers
-    struct vm_reg mvendorid;
-    struct vm_reg marchid;
-    struct vm_reg mimpid;
-    struct vm_reg mhartid;
-
-    // Machine trap setup registers
-    struct vm_reg mstatus;
-    struct vm_reg misa;
-    struct vm_reg medeleg;
-    struct vm_reg mideleg;
-    struct vm_reg mie;
-    struct vm_reg mtvec;
-    struct vm_reg mcounteren;
-
-    // Machine trap handling registers
-    struct vm_reg mscratch;
-    struct vm_reg mepc;
-    struct vm_reg mcause;
-    struct vm_reg mtval;
-    struct vm_reg mip;
-
-    // Machine physical memory protection registers
-    struct vm_reg pmpcfg[16];
-    struct vm_reg pmpaddr[64];
-
-    // Privilege mode and page table setup
-    uint64 priviledge_mode;    // 0: U-mode, 1: S-mode, 2: M-mode
-    bool pmp_setup;            // Is PMP configured?
-    pagetable_t pmp_pagetable; // PMP page table
-    pagetable_t og_pagetable;  // Original page table
-};
+void trap_and_emulate_init(void)
+{
+    struct csrdesc *d;
 
-struct vm_virtual_state vm_state;
-
-struct vm_reg* get_csr_reg(uint32 csr_address, struct vm_virtual_state *vm_state)
-{
-    switch (csr_address)
-    {
-    // User trap setup
-    case CSR_USTATUS:
-        return &vm_state->ustatus;
-    case CSR_UIE:
-        return &vm_state->uie;
-    case CSR_UTVEC:
-        return &vm_state->utvec;
-
-    // User trap handling
-    case CSR_USCRATCH:
-        return &vm_state->uscratch;
-    case CSR_UEPC:
-        return &vm_state->uepc;
-    case CSR_UCAUSE:
-        return &vm_state->ucause;
-    case CSR_UTVAL:
-        return &vm_state->utval;
-    case CSR_UIP:
-        return &vm_state->uip;
-
-    // Supervisor trap setup
-    case CSR_SSTATUS:
-        return &vm_state->sstatus;
-    case CSR_SEDELEG:
-        return &vm_state->sedeleg;
-    case CSR_SIDELEG:
-        return &vm_state->sideleg;
-    case CSR_SIE:
-        return &vm_state->sie;
-    case CSR_STVEC:
-        return &vm_state->stvec;
-    case CSR_SCOUNTEREN:
-        return &vm_state->scounteren;
-
-    // Supervisor trap handling
-    case CSR_SSCRATCH:
-        return &vm_state->sscratch;
-    case CSR_SEPC:
-        return &vm_state->sepc;
-    case CSR_SCAUSE:
-        return &vm_state->scause;
-    case CSR_STVAL:
-        return &vm_state->stval;
-    case CSR_SIP:
-        return &vm_state->sip;
-
-    // Supervisor page table register
-    case CSR_SATP:
-        return &vm_state->satp;
-
-    // Machine information registers
-    case CSR_MVENDORID:
-        return &vm_state->mvendorid;
-    case CSR_MARCHID:
-        return &vm_state->marchid;
-    case CSR_MIMPID:
-        return &vm_state->mimpid;
-    case CSR_MHARTID:
-        return &vm_state->mhartid;
-
-    // Machine trap setup registers
-    case CSR_MSTATUS:
-        return &vm_state->mstatus;
-    case CSR_MISA:
-        return &vm_state->misa;
-    case CSR_MEDELEG:
-        return &vm_state->medeleg;
-    case CSR_MIDELEG:
-        return &vm_state->mideleg;
-    case CSR_MIE:
-        return &vm_state->mie;
-    case CSR_MTVEC:
-        return &vm_state->mtvec;
-    case CSR_MCOUNTEREN:
-        return &vm_state->mcounteren;
-
-    // Machine trap handling registers
-    case CSR_MSCRATCH:
-        return &vm_state->mscratch;
-    case CSR_MEPC:
-        return &vm_state->mepc;
-    case CSR_MCAUSE:
-        return &vm_state->mcause;
-    case CSR_MTVAL:
-        return &vm_state->mtval;
-    case CSR_MIP:
-        return &vm_state->mip;
-
-    // Machine physical memory protection registers
-    case CSR_PMPCFG_BASE ...(CSR_PMPCFG_BASE + 15): // pmpcfg0 to pmpcfg15
-        vm_state->pmp_setup = true;                 // enbaling PMP is any of cgf registers is being used in the instruction
-        return &vm_state->pmpcfg[csr_address - CSR_PMPCFG_BASE];
-    case CSR_PMPADDR_BASE ...(CSR_PMPADDR_BASE + 63): // pmpaddr0 to pmpaddr63
-        vm_state->pmp_setup = true;
-        return &vm_state->pmpaddr[csr_address - CSR_PMPADDR_BASE];
-
-    // Default case
-    default:
-    
-        panic("Trap and Emulate : Unknown CSR address!!");
+    initlock(&vmtotals.lock, "vmtotals");
+    initlock(&vmidle, "vmidle");
+    vmmem_init();
+    vmimage_init();
+    vmmerge_init();
+    vcpu_init();
+
+    if (sizeof(struct vm_virtual_state) > PGSIZE)
+        panic("trap_and_emulate_init: vm_virtual_state too big");
+
+    for (int i = 0; i < NELEM(csrspec); i++)
+    {
+        d = &csrtab[csrspec[i].csr];
+        d->slot = csrspec[i].slot;
+        d->priv = csrspec[i].priv;
+        d->flags = csrspec[i].flags;
+        d->wmask = csrspec[i].wmask;
+    }
+
+    // Machine physical memory protection: pmpcfg0-14, pmpaddr0-63.
+    // On RV64 the odd-numbered pmpcfg registers do not exist.
+    for (int i = 0; i < 16; i += 2)
+    {
+        d = &csrtab[CSR_PMPCFG_BASE + i];
+        d->slot = VCSR_PMPCFG0 + i;
+        d->priv = M_MODE;
+        d->flags = CSRF_PMP;
+        d->wmask = ALLBITS;
+    }
+    for (int i = 0; i < 64; i++)
+    {
+        d = &csrtab[CSR_PMPADDR_BASE + i];
+        d->slot = VCSR_PMPADDR0 + i;
+        d->priv = M_MODE;
+        d->flags = CSRF_PMP;
+        d->wmask = (1UL << 54) - 1;
     }
 }
 
-void init_reg(int MODE, uint32 code, uint64 val) {
-    struct vm_reg tempReg;
-    tempReg.code = code; 
-    tempReg.mode = MODE;
-    tempReg.val = val; 
+// Give process p a fresh VM, whose guest-physical memory is
+// mapped by pagetable: allocate its state page if it does not
+// have one yet, and reset the virtual CSRs. The VM gets as much
+// RAM as p->vmcfg asks for; vmmem_fault() backs it on demand.
+// Called by exec() for vm-* images.
+// Returns 0 on success, -1 if out of memory.
+int trap_and_emulate_vminit(struct proc *p, pagetable_t pagetable)
+{
+    struct vm_virtual_state *vs = p->vm_state;
 
-    struct vm_reg* regPtr = get_csr_reg(code, &vm_state);
-    if (regPtr != NULL) {
-        *regPtr = tempReg;
+    if (vs == 0)
+    {
+        if ((vs = (struct vm_virtual_state *)kalloc()) == 0)
+            return -1;
+        memset(vs, 0, sizeof(*vs));
+        p->vm_state = vs;
+        acquire(&vmtotals.lock);
+        vmtotals.nvm++;
+        release(&vmtotals.lock);
     }
+
+    /* Create and initialize all state for the VM */
+    // All CSRs, including PMP, start out as zero.
+    // Keep the trace ring, if any, but empty it, and drop
+    // the shadows of the old image.
+    struct vmtrace_ring *tr = vs->trace;
+    struct vm_stats *st = vs->stats;
+    shadow_flush(p);
+    pmp_free(p);
+    memset(vs, 0, sizeof(*vs));
+    if ((vs->trace = tr) != 0)
+        tr->head = tr->tail = 0;
+    if (st == 0 && (st = (struct vm_stats *)kalloc()) == 0)
+        return -1;
+    memset(st, 0, sizeof(*st));
+    st->start = r_time();
+    vs->stats = st;
+
+    vs->csr[VCSR_MVENDORID] = 0x637365353336; // Set mvendorid to "cse536" in HEX
+    vs->priviledge_mode = M_MODE;             // VM should boot at M-Mode
+
+    vs->pmp_setup = false;
+    vs->og_pagetable = pagetable;
+    vs->memsize = p->vmcfg.memsize ? p->vmcfg.memsize : VMDEFMEM;
+    vs->mtimecmp = ~0UL;
+    vs->halt_poll = VMHALTPOLLMIN;
+
+    // vCPUs share the page tables, which must not change under
+    // them; see vcpu.c.
+    if (p->vmcfg.ncpu > 1 && vmmem_populate(p) < 0)
+    {
+        vmmem_free(p);
+        return -1;
+    }
+    printf("Created a VM process with memory region (%p - %p).\n",
+           VMRAMBASE, VMRAMBASE + vs->memsize);
+    return 0;
 }
 
-void trap_and_emulate_init(void)
+// Give np, a new process whose base page table already maps
+// the template's memory, a copy of template VM state tvs: its
+// virtual CSRs, privilege mode and devices, but none of the
+// host-side caches, which np builds afresh, nor its counters.
+// The caller switches np to the page table for its mode.
+// Returns 0 on success, -1 if out of memory.
+int trap_and_emulate_vmclone(struct proc *np, struct vm_virtual_state *tvs)
 {
-    /* Create and initialize all state for the VM */
-    // initializing user registers
-    init_reg(U_MODE, CSR_USTATUS, 0);
-    init_reg(U_MODE, CSR_UIE, 0);
-    init_reg(U_MODE, CSR_UTVEC, 0);
-    init_reg(U_MODE, CSR_USTATUS, 0);
-    init_reg(U_MODE, CSR_USCRATCH, 0);
-    init_reg(U_MODE, CSR_UEPC, 0);
-    init_reg(U_MODE, CSR_UCAUSE, 0);
-    init_reg(U_MODE, CSR_UTVAL, 0);
-    init_reg(U_MODE, CSR_UIP, 0);
-
-    // initaliazing supervisor registers
-    init_reg(S_MODE, CSR_SSTATUS, 0);
-    init_reg(S_MODE, CSR_SEDELEG, 0);
-    init_reg(S_MODE, CSR_SIDELEG, 0);
-    init_reg(S_MODE, CSR_SIE, 0);
-    init_reg(S_MODE, CSR_STVEC, 0);
-    init_reg(S_MODE, CSR_SCOUNTEREN, 0);
-    init_reg(S_MODE, CSR_SSCRATCH, 0);
-    init_reg(S_MODE, CSR_SEPC, 0);
-    init_reg(S_MODE, CSR_SCAUSE, 0);
-    init_reg(S_MODE, CSR_STVAL, 0);
-    init_reg(S_MODE, CSR_SIP, 0);
-    init_reg(S_MODE, CSR_SATP, 0);
-
-    // initailizing machine registers
-    init_reg(M_MODE, CSR_MVENDORID, 0);
-    init_reg(M_MODE, CSR_MARCHID, 0);
-    init_reg(M_MODE, CSR_MIMPID, 0);
-    init_reg(M_MODE, CSR_MHARTID, 0);
-    init_reg(M_MODE, CSR_MSTATUS, 0);
-    init_reg(M_MODE, CSR_MISA, 0);
-    init_reg(M_MODE, CSR_MEDELEG, 0);
-    init_reg(M_MODE, CSR_MIDELEG, 0);
-    init_reg(M_MODE, CSR_MIE, 0);
-    init_reg(M_MODE, CSR_MTVEC, 0);
-    init_reg(M_MODE, CSR_MCOUNTEREN, 0);
-    init_reg(M_MODE, CSR_MSCRATCH, 0);
-    init_reg(M_MODE, CSR_MEPC, 0);
-    init_reg(M_MODE, CSR_MCAUSE, 0);
-    init_reg(M_MODE, CSR_MTVAL, 0);
-    init_reg(M_MODE, CSR_MIP, 0);
-
-    // Machine physical memory protection
-    for (int i = 0; i < 16; i++)
-    {
-        vm_state.pmpcfg[i].code = CSR_PMPCFG_BASE + i;
-        vm_state.pmpcfg[i].mode = M_MODE;
-        vm_state.pmpcfg[i].val = 0x0;
+    struct vm_virtual_state *vs;
+
+    if ((vs = (struct vm_virtual_state *)kalloc()) == 0)
+        return -1;
+    memset(vs, 0, sizeof(*vs));
+    if ((vs->stats = (struct vm_stats *)kalloc()) == 0)
+    {
+        kfree((void *)vs);
+        return -1;
     }
+    memset(vs->stats, 0, sizeof(*vs->stats));
+    vs->stats->start = r_time();
+    memmove(vs->csr, tvs->csr, sizeof(vs->csr));
+    vs->priviledge_mode = tvs->priviledge_mode;
+    vs->pmp_setup = tvs->pmp_setup;
+    vs->pmp_dirty = true;
+    vs->og_pagetable = np->pagetable;
+    vs->memsize = tvs->memsize;
+    vs->shadow_status = tvs->shadow_status;
+    vs->mtimecmp = tvs->mtimecmp;
+    vs->uart = tvs->uart;
+    vs->halt_poll = tvs->halt_poll;
+    vs->cons_ring = tvs->cons_ring;
+    vs->stub = tvs->stub;
+    vs->stub_used = tvs->stub_used;
+    vs->balloon = tvs->balloon;
+    np->vm_state = vs;
+
+    acquire(&vmtotals.lock);
+    vmtotals.nvm++;
+    release(&vmtotals.lock);
+    return 0;
+}
 
-    for (int i = 0; i < 64; i++)
+// Give np, a new process, the state of a new vCPU hartid of
+// the VM whose vCPU 0 has state tvs, as the hart would have at
+// reset. The caller shares the VM's memory with np.
+// Returns 0 on success, -1 if out of memory.
+int trap_and_emulate_vcpu(struct proc *np, struct vm_virtual_state *tvs, int hartid)
+{
+    struct vm_virtual_state *vs;
+
+    if ((vs = (struct vm_virtual_state *)kalloc()) == 0)
+        return -1;
+    memset(vs, 0, sizeof(*vs));
+    if ((vs->stats = (struct vm_stats *)kalloc()) == 0)
+    {
+        kfree((void *)vs);
+        return -1;
+    }
+    memset(vs->stats, 0, sizeof(*vs->stats));
+    vs->stats->start = r_time();
+    vs->csr[VCSR_MVENDORID] = tvs->csr[VCSR_MVENDORID];
+    vs->csr[VCSR_MHARTID] = hartid;
+    vs->priviledge_mode = M_MODE;
+    vs->og_pagetable = np->pagetable;
+    vs->memsize = tvs->memsize;
+    vs->mtimecmp = ~0UL;
+    vs->halt_poll = VMHALTPOLLMIN;
+    np->vm_state = vs;
+    return 0;
+}
+
+// Add the exit statistics in from to those in to.
+static void stats_add(struct vm_stats *to, struct vm_stats *from)
+{
+    to->exits += from->exits;
+    for (int i = 0; i < VMSTAT_NCAUSE; i++)
+        to->cause[i] += from->cause[i];
+    for (int i = 0; i < VMSTAT_NINSN; i++)
+        to->insn[i] += from->insn[i];
+    for (int i = 0; i < NVCSR; i++)
+        to->csr[i] += from->csr[i];
+    for (int k = 0; k < VMSTAT_NKIND; k++)
+        for (int i = 0; i < VMSTAT_NHIST; i++)
+            to->hist[k][i] += from->hist[k][i];
+}
+
+// Release p's VM state, folding its counters into vmtotals.
+// Called with p->lock held, or when p is not yet visible.
+void trap_and_emulate_vmfree(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (vs == 0)
+        return;
+    acquire(&vmtotals.lock);
+    if (vs->csr[VCSR_MHARTID] == 0)
+        vmtotals.nvm--;     // a VM's other vCPUs are not counted
+    vmtotals.exits += vs->exits;
+    vmtotals.emulated += vs->emulated;
+    vmtotals.dcache_hits += vs->dcache_hits;
+    vmtotals.dcache_misses += vs->dcache_misses;
+    vmtotals.batched += vs->batched;
+    vmtotals.cycles += vs->cycles;
+    vmtotals.tracedropped += vs->tracedropped;
+    vmtotals.mmio += vs->mmio;
+    vmtotals.mmiofast += vs->mmiofast;
+    vmtotals.injected += vs->injected;
+    vmtotals.wfi += vs->wfi;
+    vmtotals.polled += vs->polled;
+    vmtotals.halted += vs->halted;
+    vmtotals.ramfaults += vs->ramfaults;
+    vmtotals.cowfaults += vs->cowfaults;
+    vmtotals.hypercalls += vs->hypercalls;
+    vmtotals.consbytes += vs->consbytes;
+    vmtotals.patched += vs->patched;
+    vmtotals.imageshared += vs->imageshared;
+    vmtotals.ballooned += vs->ballooned;
+    vmtotals.ckptloads += vs->ckptloads;
+    if (vs->stats)
+    {
+        stats_add(&vmtotals.stats, vs->stats);
+        vmtotals.stattime += r_time() - vs->stats->start;
+    }
+    release(&vmtotals.lock);
+
+    shadow_flush(p);
+    pmp_free(p);
+    p->vm_state = 0;
+    if (vs->trace)
+        kfree((void *)vs->trace);
+    if (vs->stats)
+        kfree((void *)vs->stats);
+    kfree((void *)vs);
+}
+
+// Fill in *vi for the VM process pid, or with system-wide
+// totals (exited VMs plus running ones) if pid is 0.
+// Returns 0 on success, -1 if pid is not a VM.
+int trap_and_emulate_info(int pid, struct vminfo *vi)
+{
+    struct proc *p;
+    int found = 0;
+
+    memset(vi, 0, sizeof(*vi));
+    vi->pid = pid;
+    if (pid == 0)
+    {
+        acquire(&vmtotals.lock);
+        vi->nvm = vmtotals.nvm;
+        vi->exits = vmtotals.exits;
+        vi->emulated = vmtotals.emulated;
+        vi->dcache_hits = vmtotals.dcache_hits;
+        vi->dcache_misses = vmtotals.dcache_misses;
+        vi->batched = vmtotals.batched;
+        vi->cycles = vmtotals.cycles;
+        vi->tracedropped = vmtotals.tracedropped;
+        vi->mmio = vmtotals.mmio;
+        vi->mmiofast = vmtotals.mmiofast;
+        vi->injected = vmtotals.injected;
+        vi->wfi = vmtotals.wfi;
+        vi->polled = vmtotals.polled;
+        vi->halted = vmtotals.halted;
+        vi->ramfaults = vmtotals.ramfaults;
+        vi->cowfaults = vmtotals.cowfaults;
+        vi->hypercalls = vmtotals.hypercalls;
+        vi->consbytes = vmtotals.consbytes;
+        vi->patched = vmtotals.patched;
+        vi->imageshared = vmtotals.imageshared;
+        vi->ballooned = vmtotals.ballooned;
+        vi->ckptloads = vmtotals.ckptloads;
+        release(&vmtotals.lock);
+    }
+
+    for (p = proc; p < &proc[NPROC]; p++)
+    {
+        // p->lock keeps freeproc() from releasing vm_state under us.
+        acquire(&p->lock);
+        if (p->vm_state && (pid == 0 || p->pid == pid))
+        {
+            vi->exits += p->vm_state->exits;
+            vi->emulated += p->vm_state->emulated;
+            vi->dcache_hits += p->vm_state->dcache_hits;
+            vi->dcache_misses += p->vm_state->dcache_misses;
+            vi->batched += p->vm_state->batched;
+            vi->cycles += p->vm_state->cycles;
+            vi->tracedropped += p->vm_state->tracedropped;
+            vi->mmio += p->vm_state->mmio;
+            vi->mmiofast += p->vm_state->mmiofast;
+            vi->injected += p->vm_state->injected;
+            vi->wfi += p->vm_state->wfi;
+            vi->polled += p->vm_state->polled;
+            vi->halted += p->vm_state->halted;
+            vi->ramfaults += p->vm_state->ramfaults;
+            vi->cowfaults += p->vm_state->cowfaults;
+            vi->hypercalls += p->vm_state->hypercalls;
+            vi->consbytes += p->vm_state->consbytes;
+            vi->patched += p->vm_state->patched;
+            vi->imageshared += p->vm_state->imageshared;
+            vi->ballooned += p->vm_state->ballooned;
+            vi->ckptloads += p->vm_state->ckptloads;
+            vi->balloon += p->vm_state->balloon;
+            found = 1;
+        }
+        release(&p->lock);
+    }
+    return (pid == 0 || found) ? 0 : -1;
+}
+
+// An exit of VM process p, for scause, begins: count it, and
+// start timing it. Called by vmtrap() on entry.
+void trap_and_emulate_exitstart(struct proc *p, uint64 scause)
+{
+    struct vm_stats *st;
+
+    if (p->vm_state == 0 || (st = p->vm_state->stats) == 0)
+        return;
+    st->exit_start = r_time();
+    st->exits++;
+    if ((scause & 0xF) == (scause & ~(1UL << 63)))
+        st->cause[(scause >> 63) * 16 + (scause & 0xF)]++;
+    if (scause >> 63)
+        st->exit_kind = VMX_INTR;
+    else if (scause == 12 || scause == 13 || scause == 15)
+        st->exit_kind = VMX_FAULT;
+    else
+        st->exit_kind = VMX_INSN; // emulate() may make it VMX_WFI
+}
+
+// The exit of VM process p is over: add the time it took to
+// the histogram for its kind. Called by vmtrap() just before
+// usertrapret().
+void trap_and_emulate_exitend(struct proc *p)
+{
+    struct vm_stats *st;
+    uint64 d;
+    int b;
+
+    if (p->vm_state == 0 || (st = p->vm_state->stats) == 0 || st->exit_start == 0)
+        return;
+    d = r_time() - st->exit_start;
+    for (b = 0; d > 1 && b < VMSTAT_NHIST - 1; b++)
+        d >>= 1;
+    st->hist[st->exit_kind][b]++;
+    st->exit_start = 0;
+}
+
+// Copy the exit statistics of VM process pid, or of all VMs
+// including exited ones if pid is 0, to user address dst.
+// Returns 0 on success, -1 if pid is not a VM.
+int trap_and_emulate_stat(int pid, uint64 dst)
+{
+    struct vm_stats *sum;
+    struct vmstat *out;
+    struct proc *p;
+    uint64 time = 0, now = r_time();
+    int found = 0, n = 0, r = -1;
+
+    if ((sum = (struct vm_stats *)kalloc()) == 0)
+        return -1;
+    if ((out = (struct vmstat *)kalloc()) == 0)
+    {
+        kfree((void *)sum);
+        return -1;
+    }
+    memset(sum, 0, sizeof(*sum));
+    memset(out, 0, sizeof(*out));
+
+    if (pid == 0)
+    {
+        acquire(&vmtotals.lock);
+        stats_add(sum, &vmtotals.stats);
+        time = vmtotals.stattime;
+        release(&vmtotals.lock);
+    }
+    for (p = proc; p < &proc[NPROC]; p++)
+    {
+        // p->lock keeps freeproc() from releasing the stats under us.
+        acquire(&p->lock);
+        if ((pid == 0 || p->pid == pid) && p->vm_state && p->vm_state->stats)
+        {
+            stats_add(sum, p->vm_state->stats);
+            time += now - p->vm_state->stats->start;
+            found = 1;
+        }
+        release(&p->lock);
+    }
+
+    if (pid == 0 || found)
     {
-        vm_state.pmpaddr[i].code = CSR_PMPADDR_BASE + i;
-        vm_state.pmpaddr[i].mode = M_MODE;
-        vm_state.pmpaddr[i].val = 0x0;
+        out->pid = pid;
+        out->time = time;
+        out->exits = sum->exits;
+        memmove(out->cause, sum->cause, sizeof(out->cause));
+        memmove(out->insn, sum->insn, sizeof(out->insn));
+        memmove(out->hist, sum->hist, sizeof(out->hist));
+        for (int a = 0; a < NELEM(csrtab) && n < VMSTAT_NCSR; a++)
+        {
+            if (csrtab[a].slot != VCSR_NONE && sum->csr[csrtab[a].slot])
+            {
+                out->csr[n].csr = a;
+                out->csr[n].n = sum->csr[csrtab[a].slot];
+                n++;
+            }
+        }
+        r = copyout(myproc()->pagetable, dst, (char *)out, sizeof(*out));
     }
+    kfree((void *)sum);
+    kfree((void *)out);
+    return r;
+}
 
-    vm_state.mvendorid.val = 0x637365353336; // Set mvendorid to "cse536" in HEX
-    vm_state.priviledge_mode = M_MODE;       // VM should boot at M-Mode
+// Change VM setting op of process pid (the caller if pid is 0)
+// to val. A running VM picks the change up at its next exit.
+// Returns 0 on success, -1 if there is no such process or the
+// setting is invalid.
+int trap_and_emulate_ctl(int pid, int op, uint64 val)
+{
+    struct proc *p;
+    int r = -1;
+
+    if (pid == 0)
+        pid = myproc()->pid;
 
-    vm_state.pmp_setup = false;
+    for (p = proc; p < &proc[NPROC]; p++)
+    {
+        acquire(&p->lock);
+        if (p->pid == pid && p->state != UNUSED)
+        {
+            switch (op)
+            {
+            case VMCTL_EXITBUDGET:
+                if (val <= VMMAXEXITBUDGET)
+                {
+                    p->vmcfg.exitbudget = val;
+                    r = 0;
+                }
+                break;
+            case VMCTL_TRACE:
+                if (val <= VMTRACE_ALL)
+                {
+                    p->vmcfg.trace = val;
+                    r = 0;
+                }
+                break;
+            case VMCTL_MEMSIZE:
+                if (val % PGSIZE == 0 && val <= VMMAXMEM)
+                {
+                    p->vmcfg.memsize = val;
+                    r = 0;
+                }
+                break;
+            case VMCTL_CONSFD:
+                // checked again when the guest writes.
+                if ((int)val == -1 || ((int)val >= 0 && (int)val < NOFILE && p->ofile[(int)val]))
+                {
+                    p->vmcfg.consfd = (int)val;
+                    r = 0;
+                }
+                break;
+            case VMCTL_PATCH:
+                if (val <= 1)
+                {
+                    p->vmcfg.nopatch = !val;
+                    r = 0;
+                }
+                break;
+            case VMCTL_NCPU:
+                if (val >= 1 && val <= NVCPU)
+                {
+                    p->vmcfg.ncpu = val;
+                    r = 0;
+                }
+                break;
+            case VMCTL_BALLOON:
+                // the guest sees it in HC_BALLOON.
+                if (p->vm_state && val <= p->vm_state->memsize / PGSIZE)
+                {
+                    p->vm_state->balloon_target = val;
+                    r = 0;
+                }
+                break;
+            }
+            release(&p->lock);
+            return r;
+        }
+        release(&p->lock);
+    }
+    return -1;
+}
+
+static void emulate_illegal(struct proc *p, struct vm_insn *vi)
+{
+    printf("Instruction is not correct.\n");
+    setkilled(p);
 }
 
-void emulate_sret(struct proc *p)
+static void emulate_unsupported(struct proc *p, struct vm_insn *vi)
 {
+    printf("Unsupported opcode in trap_and_emulate()\n");
+    setkilled(p);
+}
+
+void emulate_sret(struct proc *p, struct vm_insn *vi)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (vs->priviledge_mode != S_MODE)
+    {
+        emulate_illegal(p, vi);
+        return;
+    }
+    vs->emulated++;
+
     // Step 1: Retrieve the previous program counter (sepc)
-    uint64 sepc = vm_state.sepc.val;
+    uint64 sepc = vs->csr[VCSR_SEPC];
 
     // Step 2: Decode the SPP (Supervisor Previous Privilege) field from sstatus
-    uint64 sstatus = vm_state.sstatus.val;
+    uint64 sstatus = vs->csr[VCSR_SSTATUS];
     uint64 spp = (sstatus >> 8) & 0x1; // SPP is bit 8 in sstatus
 
     // Step 3: Restore the privilege mode based on SPP
     if (spp == 0)
     {
-        vm_state.priviledge_mode = 0; // Return to User mode
+        vs->priviledge_mode = 0; // Return to User mode
     }
     else if (spp == 1)
     {
-        vm_state.priviledge_mode = 1; // Return to Supervisor mode
+        vs->priviledge_mode = 1; // Return to Supervisor mode
     }
     else
     {
+        printf("Invalid SPP value during SRET emulation\n");
         setkilled(p);
-        panic("Invalid SPP value during SRET emulation");
+        return;
     }
 
+    // Step 4: Restore SIE from SPIE, and clear SPP
+    sstatus &= ~(SSTATUS_SPP | SSTATUS_SIE);
+    if (sstatus & SSTATUS_SPIE)
+        sstatus |= SSTATUS_SIE;
+    sstatus |= SSTATUS_SPIE;
+    vs->csr[VCSR_SSTATUS] = sstatus;
+
     p->trapframe->epc = sepc;
 }
 
-void emulate_mret(struct proc *p)
+void emulate_mret(struct proc *p, struct vm_insn *vi)
 {
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (vs->priviledge_mode != M_MODE)
+    {
+        emulate_illegal(p, vi);
+        return;
+    }
+    vs->emulated++;
+
     // Step 1: Retrieve the previous program counter (mepc)
-    uint64 mepc = vm_state.mepc.val;
+    uint64 mepc = vs->csr[VCSR_MEPC];
 
     // Step 2: Decode the MPP (Machine Previous Privilege) field from mstatus
-    uint64 mstatus = vm_state.mstatus.val;
+    uint64 mstatus = vs->csr[VCSR_MSTATUS];
     uint64 mpp = (mstatus >> 11) & 0x3; // MPP is bits [12:11]
 
     // Step 3: Restore the privilege mode based on MPP
     if (mpp == 0)
     {
-        vm_state.priviledge_mode = U_MODE; // Return to User mode
+        vs->priviledge_mode = U_MODE; // Return to User mode
     }
     else if (mpp == 1)
     {
-        vm_state.priviledge_mode = S_MODE; // Return to Supervisor mode
+        vs->priviledge_mode = S_MODE; // Return to Supervisor mode
     }
     else if (mpp == 3)
     {
-        vm_state.priviledge_mode = M_MODE; // Return to Machine mode
+        vs->priviledge_mode = M_MODE; // Return to Machine mode
     }
     else
     {
+        printf("Invalid MPP value during MRET emulation\n");
         setkilled(p);
-        panic("Invalid MPP value during MRET emulation");
+        return;
     }
 
     // Step 4: Clear the MPP field in mstatus
     mstatus &= ~(3UL << 11); // Clear bits [12:11] (MPP)
 
-    // Step 5: Restore the MIE (Machine Interrupt Enable) bit
-    mstatus |= (mstatus & (1UL << 3)); // Preserve MIE bit (bit 3)
+    // Step 5: Restore the MIE (Machine Interrupt Enable) bit from MPIE
+    mstatus &= ~MSTATUS_MIE;
+    if (mstatus & MSTATUS_MPIE)
+        mstatus |= MSTATUS_MIE;
+    mstatus |= MSTATUS_MPIE;
 
     // Update the mstatus register in the VM state
-    vm_state.mstatus.val = mstatus;
+    vs->csr[VCSR_MSTATUS] = mstatus;
 
     // Step 6: Set the program counter to the saved exception program counter (mepc)
     p->trapframe->epc = mepc;
-
-    // handle PMP protection here
 }
 
-void emulate_ecall(int current_mode, struct proc *p)
+// Take trap cause, with trap value tval, into the guest's
+// S-mode if tos, else its M-mode, as its hart would: save the
+// pc and privilege mode, disable interrupts, and jump to the
+// trap vector, or for an interrupt in vectored mode to the
+// vector's entry for the cause.
+static void take_trap(struct proc *p, uint64 cause, uint64 tval, bool tos)
 {
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 mode = vs->priviledge_mode;
+    uint64 tvec = vs->csr[tos ? VCSR_STVEC : VCSR_MTVEC];
+    uint64 x;
 
-    printf("(EC at %p)\n", p->trapframe->epc);
-    // 1. Set the trap cause
-    if (current_mode == U_MODE)
-    {                            // U-mode
-        vm_state.scause.val = 8; // Environment call from U-mode
-    }
-    else if (current_mode == S_MODE)
-    {                            // S-mode
-        vm_state.scause.val = 9; // Environment call from S-mode
+    if (tos)
+    {
+        vs->csr[VCSR_SEPC] = p->trapframe->epc;
+        vs->csr[VCSR_SCAUSE] = cause;
+        vs->csr[VCSR_STVAL] = tval;
+        x = vs->csr[VCSR_SSTATUS] & ~(SSTATUS_SPP | SSTATUS_SPIE | SSTATUS_SIE);
+        if (mode == S_MODE)
+            x |= SSTATUS_SPP;
+        if (vs->csr[VCSR_SSTATUS] & SSTATUS_SIE)
+            x |= SSTATUS_SPIE;
+        vs->csr[VCSR_SSTATUS] = x;
+        vs->priviledge_mode = S_MODE;
     }
     else
     {
-        panic("ECALL from unsupported privilege mode! Maybe from M Mode :(");
+        vs->csr[VCSR_MEPC] = p->trapframe->epc;
+        vs->csr[VCSR_MCAUSE] = cause;
+        vs->csr[VCSR_MTVAL] = tval;
+        x = vs->csr[VCSR_MSTATUS] & ~(MSTATUS_MPP_MASK | MSTATUS_MPIE | MSTATUS_MIE);
+        x |= mode << 11;
+        if (vs->csr[VCSR_MSTATUS] & MSTATUS_MIE)
+            x |= MSTATUS_MPIE;
+        vs->csr[VCSR_MSTATUS] = x;
+        vs->priviledge_mode = M_MODE;
     }
+    p->trapframe->epc = tvec & ~0x3UL;
+    if ((cause >> 63) && (tvec & 0x3) == 1)
+        p->trapframe->epc += 4 * (cause & 0x3F);
+    shadow_switch(p);
+}
+
+// Deliver exception cause, with trap value tval, to the guest
+// as its hart would: to S-mode if the exception is delegated
+// in medeleg and the guest is not in M-mode, else to M-mode.
+void trap_and_emulate_raise(struct proc *p, uint64 cause, uint64 tval)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    take_trap(p, cause, tval,
+              vs->priviledge_mode != M_MODE && ((vs->csr[VCSR_MEDELEG] >> cause) & 1));
+}
 
-    // 2. Save the program counter to sepc
-    vm_state.sepc.val = p->trapframe->epc;
+// Interrupt causes in the order a hart takes them when several
+// are pending: external, software, timer, M-level first.
+static const uchar intrprio[] = { 11, 3, 7, 9, 1, 5 };
 
-    // 3. Determine the next privilege mode and set the trap handler
-    if (current_mode == U_MODE)
+// Bring mip.MTIP up to date with the guest's view of time,
+// and mip.MSIP with the other vCPUs' writes to its msip.
+// Returns true if the guest has an interrupt pending that mie
+// or sie enables, which would end a wfi.
+static bool vtimer_sync(struct vm_virtual_state *vs)
+{
+    int msip;
+
+    if ((msip = __sync_lock_test_and_set(&vs->msip_req, 0)) == 2)
+        vs->csr[VCSR_MIP] |= MIP_MSIP;
+    else if (msip == 1)
+        vs->csr[VCSR_MIP] &= ~MIP_MSIP;
+    if (r_time() >= vs->mtimecmp)
+        vs->csr[VCSR_MIP] |= MIP_MTIP;
+    else
+        vs->csr[VCSR_MIP] &= ~MIP_MTIP;
+    return ((vs->csr[VCSR_MIP] | vs->csr[VCSR_SIP]) &
+            (vs->csr[VCSR_MIE] | vs->csr[VCSR_SIE])) != 0;
+}
+
+// The guest's highest-priority interrupt that is pending and
+// enabled in its current mode, or -1 if none; *tos is set if it
+// is delegated to S-mode.
+static int intr_next(struct vm_virtual_state *vs, bool *tos)
+{
+    uint64 mode, mip, m, s;
+
+    // Interrupts not delegated in mideleg go to M-mode, and are
+    // enabled by mie, and by mstatus.MIE while in M-mode. Those
+    // delegated go to S-mode, and are enabled by sie, and by
+    // sstatus.SIE while in S-mode; M-mode never takes them.
+    mode = vs->priviledge_mode;
+    mip = vs->csr[VCSR_MIP] | vs->csr[VCSR_SIP];
+    m = mip & vs->csr[VCSR_MIE] & ~vs->csr[VCSR_MIDELEG];
+    if (mode == M_MODE && (vs->csr[VCSR_MSTATUS] & MSTATUS_MIE) == 0)
+        m = 0;
+    s = mip & vs->csr[VCSR_SIE] & vs->csr[VCSR_MIDELEG];
+    if (mode == M_MODE || (mode == S_MODE && (vs->csr[VCSR_SSTATUS] & SSTATUS_SIE) == 0))
+        s = 0;
+
+    for (int i = 0; i < NELEM(intrprio); i++)
     {
-        // U-mode to S-mode transition
-        vm_state.priviledge_mode = 1;           // Transition to Supervisor mode
-        p->trapframe->epc = vm_state.stvec.val; // Set PC to Supervisor trap handler
+        if (((m | s) >> intrprio[i]) & 1)
+        {
+            *tos = (s >> intrprio[i]) & 1;
+            return intrprio[i];
+        }
     }
-    else if (current_mode == S_MODE)
+    return -1;
+}
+
+// Bring the guest's view of time up to date, and deliver its
+// highest-priority pending and enabled interrupt as its hart
+// would before running its next instruction. While the virtual
+// timer is enabled and not yet due, ask the host for an
+// interrupt at its deadline, so that the guest gets the CPU
+// back then even if it never exits.
+// Called by vmtrap() on every return to the guest.
+void trap_and_emulate_intr(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    bool tos;
+    int cause;
+
+    if (vs == 0)
+        return;
+    vtimer_sync(vs);
+    if ((vs->csr[VCSR_MIP] & MIP_MTIP) == 0 && (vs->csr[VCSR_MIE] & MIE_MTIE))
+        timerarm(vs->mtimecmp);
+
+    if ((cause = intr_next(vs, &tos)) >= 0)
     {
-        // S-mode to M-mode transition (if configured)
-        vm_state.priviledge_mode = 0;           // Transition to Machine mode
-        p->trapframe->epc = vm_state.mtvec.val; // Set PC to Machine trap handler
+        vs->injected++;
+        take_trap(p, (1UL << 63) | cause, 0, tos);
     }
+}
 
-    // 4. Setting up page table
-    /*
-    if (current_mode == U_MODE) {
-        if(vm_state.pmp_setup == true)
-            p->pagetable = vm_state.pmp_pagetable;
+// A timer interrupt arrived: wake the VMs halted in wfi, so
+// that those whose deadline has passed can run. Called from
+// devintr().
+void trap_and_emulate_timer(void)
+{
+    acquire(&vmidle);
+    wakeup(&vmidle);
+    release(&vmidle);
+}
+
+// Wait for the guest to have an interrupt pending. An idle
+// guest often gets one soon, so first poll for up to vs->halt_poll
+// cycles, which costs less than going to sleep and being woken.
+// If none comes, sleep until the virtual timer's deadline, which
+// the host timer is armed for. Like KVM's halt-polling, the
+// window grows while waits are short enough to be caught by
+// polling, and shrinks when they are too long to be.
+static void halt(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 start = r_time(), waited;
+    bool polled;
+
+    while (!(polled = vtimer_sync(vs)) && r_time() - start < vs->halt_poll)
+        ;
+
+    if (!polled)
+    {
+        // a prompt, say, should not wait for the wakeup.
+        mmio_flush(p);
+        acquire(&vmidle);
+        // vmmerge may remap the VM's pages meanwhile.
+        vs->idle = true;
+        // a checkpoint waits for the VM to park; see vmckpt.c.
+        while (!vtimer_sync(vs) && !killed(p) && !vs->ckpt_pause)
+        {
+            // arm the timer of whichever CPU we now run on.
+            if (vs->csr[VCSR_MIE] & MIE_MTIE)
+                timerarm(vs->mtimecmp);
+            sleep(&vmidle, &vmidle);
+        }
+        vs->idle = false;
+        release(&vmidle);
     }
-    if (current_mode == S_MODE) {
-        if(vm_state.pmp_setup == true)
-            p->pagetable = vm_state.og_pagetable;
+
+    waited = r_time() - start;
+    vs->halted += waited;
+    if (polled)
+        vs->polled++;
+    else if (waited > VMHALTPOLLMAX)
+        vs->halt_poll = vs->halt_poll / 2 < VMHALTPOLLMIN ? VMHALTPOLLMIN : vs->halt_poll / 2;
+    else if (vs->halt_poll < waited)
+        vs->halt_poll = vs->halt_poll * 2 > VMHALTPOLLMAX ? VMHALTPOLLMAX : vs->halt_poll * 2;
+}
+
+// WFI: stall the guest until an interrupt is pending that mie
+// or sie enables, whether or not it is taken. Illegal in U-mode,
+// and in S-mode when mstatus.TW is set.
+void emulate_wfi(struct proc *p, struct vm_insn *vi)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (vs->priviledge_mode == U_MODE ||
+        (vs->priviledge_mode == S_MODE && (vs->csr[VCSR_MSTATUS] & MSTATUS_TW)))
+    {
+        emulate_illegal(p, vi);
+        return;
     }
-    */
+    vs->emulated++;
+    vs->wfi++;
+    p->trapframe->epc += vi->len;
+    halt(p);
 }
 
-void emulate_csrr(struct proc *p, uint32 rd, uint32 rs1, uint32 uimm)
+// SFENCE.VMA: the guest changed its page tables, so drop the
+// shadow mappings it names. rs1 holds a guest-virtual address
+// and rs2 an ASID; x0 for either means all of them.
+void emulate_sfence(struct proc *p, struct vm_insn *vi)
 {
-    if (rs1 != 0x0)
+    struct vm_virtual_state *vs = p->vm_state;
+    int rs2 = vi->imm & 0x1F;
+
+    if (vs->priviledge_mode == U_MODE ||
+        (vs->priviledge_mode == S_MODE && (vs->csr[VCSR_MSTATUS] & MSTATUS_TVM)))
     {
-        setkilled(p);
-        trap_and_emulate_init();
-        panic("Invalid CSRW instruction, destination, rs1 register is not empty");
+        emulate_illegal(p, vi);
+        return;
     }
+    vs->emulated++;
+    shadow_sfence(p, getreg(p, vi->rs1), getreg(p, rs2) & 0xFFFF, vi->rs1 == 0, rs2 == 0);
+    p->trapframe->epc += vi->len;
+}
 
-    struct vm_reg* src = get_csr_reg(uimm, &vm_state);
-    uint64 *dest = &(p->trapframe->ra) + rd - 1;
+// ECALL: a hypercall if from S-mode with HC_MAGIC in a7, else
+// an environment call exception from the guest's current mode.
+void emulate_ecall(struct proc *p, struct vm_insn *vi)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 mode = vs->priviledge_mode;
 
-    if ((uimm == CSR_MVENDORID)) // CSRR instruction can be used to read CSR_MVENDORID in all privilege modes
+    vs->emulated++;
+    if (mode == S_MODE && p->trapframe->a7 == HC_MAGIC)
     {
-        *dest = src->val;
-        p->trapframe->epc += 4;
+        hypercall(p);
         return;
     }
+    trap_and_emulate_raise(p, mode == M_MODE ? 11 : 8 + mode, 0);
+}
 
-    if (vm_state.priviledge_mode >= src->mode)
+// Look up the descriptor for a guest access to a CSR, checking
+// that the CSR exists and that the current privilege mode may
+// access it. Kills p and returns 0 if the access is illegal.
+static struct csrdesc* csr_access(struct proc *p, uint32 csr, bool write)
+{
+    struct csrdesc *d = &csrtab[csr];
+
+    if (d->slot == VCSR_NONE)
+    {
+        printf("Trap and Emulate : Unknown CSR address %x\n", csr);
+        setkilled(p);
+        return 0;
+    }
+    if (p->vm_state->priviledge_mode < d->priv)
     {
-        *dest = src->val;
-        p->trapframe->epc += 4;
+        printf("Invalid instruction %s, trying to execute higher privelaged instruction ...\n",
+               write ? "CSR write" : "CSR read");
+        setkilled(p);
+        return 0;
     }
-    else
+    if ((d->flags & CSRF_SATP) && p->vm_state->priviledge_mode == S_MODE &&
+        (p->vm_state->csr[VCSR_MSTATUS] & MSTATUS_TVM))
     {
+        printf("Trap and Emulate : satp access trapped by mstatus.TVM\n");
         setkilled(p);
-        trap_and_emulate_init();
-        panic("Invalid instruction CSRW, trying to execute higher privelaged instruction ...");
+        return 0;
     }
+    if (write && (d->flags & CSRF_RO))
+    {
+        printf("Trap and Emulate : write to read-only CSR %x\n", csr);
+        setkilled(p);
+        return 0;
+    }
+    return d;
+}
+
+// Store val into a CSR, keeping its read-only bits, and run
+// the CSR's write hook.
+static void csr_write(struct proc *p, struct csrdesc *d, uint64 val)
+{
+    uint64 *reg = &p->vm_state->csr[d->slot];
+
+    if ((d->flags & CSRF_SATP) && (val >> 60) != 0 && (val >> 60) != 8)
+        return; // only Bare and Sv39; other modes leave satp alone
+    *reg = (*reg & ~d->wmask) | (val & d->wmask);
+    if (d->flags & CSRF_PMP)
+        pmp_changed(p);
 }
 
-void emulate_csrw(struct proc *p, uint32 rd, uint32 rs1, uint32 uimm)
+// Emulate the Zicsr instructions: CSRRW, CSRRS, CSRRC and
+// their immediate forms, which take a 5-bit zero-extended
+// immediate in the rs1 field. CSRRS/CSRRC with x0 or a zero
+// immediate only read, and so may name a read-only CSR.
+// Virtual CSRs have no read side effects, so CSRRW with
+// rd == x0 needs no special case.
+void emulate_csr(struct proc *p, struct vm_insn *vi)
 {
+    struct vm_virtual_state *vs = p->vm_state;
+    int op = vi->funct3 & 0x3;    // 1: write, 2: set, 3: clear
+    uint64 src = (vi->funct3 & 0x4) ? vi->rs1 : getreg(p, vi->rs1);
+    bool write = op == 1 || vi->rs1 != 0;
+    struct csrdesc *d;
+    uint64 old;
+
+    if ((d = csr_access(p, vi->imm, write)) == 0)
+        return;
+    vs->emulated++;
 
-    if (rd != 0x0)
+    old = vs->csr[d->slot];
+    if (write)
     {
-        //printf("here1");
-        setkilled(p);
-        trap_and_emulate_init();
-        panic("Invalid CSRW instruction, destination, rd register is not empty");
+        if (op == 2)
+            src = old | src;
+        else if (op == 3)
+            src = old & ~src;
+        csr_write(p, d, src);
     }
+    setreg(p, vi->rd, old);
+    p->trapframe->epc += vi->len;
+
+    // the guest will read the same value here every time.
+    if (!write && (d->flags & CSRF_RO))
+        patch_csrr(p, vi->pc, vi->rd, old);
+}
 
-    struct vm_reg* dest = get_csr_reg(uimm, &vm_state);
-    uint64 *src = &(p->trapframe->ra) + rs1 - 1;
+// Fetch the instruction at guest address pc into *insn, a
+// half-word at a time, since it may be compressed and at the
+// end of the text, where reading 4 bytes would fault.
+// Returns its length, 2 or 4 bytes, or -1 if pc is unmapped.
+int trap_and_emulate_fetch(struct proc *p, uint64 pc, uint32 *insn)
+{
+    ushort half[2];
+
+    half[1] = 0;
+    if (copyin(p->pagetable, (char *)&half[0], pc, 2) < 0)
+        return -1;
+    if ((half[0] & 0x3) == 0x3 && copyin(p->pagetable, (char *)&half[1], pc + 2, 2) < 0)
+        return -1;
+    *insn = half[0] | ((uint32)half[1] << 16);
+    return (half[0] & 0x3) == 0x3 ? 4 : 2;
+}
+
+// Decode the privileged instruction insn at guest address pc
+// into *vi, choosing its emulation handler. Checks that depend
+// on the current privilege mode are left to the handler, so
+// that the decoded form can be cached and reused.
+static void decode(struct vm_insn *vi, uint64 pc, uint32 insn)
+{
+    vi->pc = pc;
+    vi->insn = insn;
+    vi->len = (insn & 0x3) == 0x3 ? 4 : 2;
+    vi->rd = (insn >> 7) & 0x1F;      // Bits [11:7] (destination register)
+    vi->funct3 = (insn >> 12) & 0x7;  // Bits [14:12] (funct3)
+    vi->rs1 = (insn >> 15) & 0x1F;    // Bits [19:15] (source register)
+    vi->imm = (insn >> 20) & 0xFFF;   // Bits [31:20] (CSR address)
+
+    if (vi->len == 2)
+    {
+        // no compressed instruction is privileged; C.EBREAK
+        // ends the VM, as EBREAK does.
+        vi->fn = insn == 0x9002 ? emulate_illegal : emulate_unsupported;
+        return;
+    }
+    if ((insn & 0x7F) != 0x73)
+    {
+        // only SYSTEM instructions are privileged
+        vi->fn = emulate_unsupported;
+        return;
+    }
 
-    if (vm_state.priviledge_mode >= dest->mode)
+    switch (vi->funct3)
     {
-        //printf("here2");
-        if ((uimm == CSR_MVENDORID) && (*src == 0x0))
+    case 0x0: // for ECALL, SRET, MRET, WFI & SFENCE.VMA
+        vi->fn = emulate_illegal;
+        if (vi->rd == 0x0 && (vi->imm >> 5) == 0x09)
+            vi->fn = emulate_sfence;
+        else if (vi->rd == 0x0 && vi->rs1 == 0x0)
         {
-            // cannot overrite empty value into vendorID hardware register
-            //printf("here3");
-            setkilled(p);
-            trap_and_emulate_init();
+            if (vi->imm == 0x0)
+                vi->fn = emulate_ecall;
+            else if (vi->imm == 0x102)
+                vi->fn = emulate_sret;
+            else if (vi->imm == 0x302)
+                vi->fn = emulate_mret;
+            else if (vi->imm == 0x105)
+                vi->fn = emulate_wfi;
         }
-        //printf("here4");
-        dest->val = *src;
-        p->trapframe->epc += 4;
+        break;
+    case 0x1: // CSRRW
+    case 0x2: // CSRRS
+    case 0x3: // CSRRC
+    case 0x5: // CSRRWI
+    case 0x6: // CSRRSI
+    case 0x7: // CSRRCI
+        vi->fn = emulate_csr;
+        break;
+    default:
+        vi->fn = emulate_illegal;
+        break;
     }
-    else
+}
+
+// Forget all decoded instructions, when the guest's
+// virtual-to-physical mapping of its text may have changed.
+void trap_and_emulate_flush(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    for (struct vm_insn *vi = vs->dcache; vi < &vs->dcache[NDCACHE]; vi++)
+        vi->insn = 0;
+}
+
+// Find the guest-physical address of the page holding guest
+// address va, which the guest just accessed with acc: va itself
+// while the guest's paging is off. Returns -1 if it is unmapped.
+static int dcache_gpa(struct proc *p, uint64 va, int acc, uint64 *gpa)
+{
+    if (p->vm_state->shadow_cur == 0)
     {
-        //printf("here5");
-        setkilled(p);
-        trap_and_emulate_init();
-        panic("Invalid instruction CSRW, trying to execute higher privelaged instruction ...");
+        *gpa = PGROUNDDOWN(va);
+        return 0;
     }
+    return shadow_gpa(p, va, acc, gpa);
 }
 
-// In your ECALL, add the following for prints
-// struct proc* p = myproc();
-// printf("(EC at %p)\n", p->trapframe->epc);
+// Leaf functions for vmmem_leaves(): write-protect, or make
+// writable again, a shadow mapping of the host page at arg.
+static int leaf_protect(pte_t *pte, uint64 va, void *arg)
+{
+    if (PTE2PA(*pte) == (uint64)arg && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_WP;
+    return 0;
+}
 
-void trap_and_emulate(void)
+static int leaf_unprotect(pte_t *pte, uint64 va, void *arg)
 {
-    /* Comes here when a VM tries to execute a supervisor instruction. */
+    if (PTE2PA(*pte) == (uint64)arg && (*pte & PTE_WP))
+        *pte = (*pte & ~PTE_WP) | PTE_W;
+    return 0;
+}
 
-    struct proc *p = myproc();
+// Call fn on the mappings of host page pa in all of p's shadows:
+// the guest may map a page of text at several virtual addresses.
+static void dcache_shadows(struct proc *p, uint64 pa, int (*fn)(pte_t *, uint64, void *))
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    for (struct shadow *sh = vs->shadow; sh < &vs->shadow[NSHADOW]; sh++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (sh->root[i])
+                vmmem_leaves(sh->root[i], 2, 0, fn, (void *)pa);
+        }
+    }
+}
 
-    //printf("current mode : %d", vm_state.priviledge_mode);
-    /* Retrieve all required values from the instruction */
-    uint64 addr = r_sepc();
-    uint32 instruction = 0; // in RISCV-xv6 all the instructions are 32 bit
+// Write-protect the guest-physical page holding guest text at
+// va, in the base table, its PMP-restricted copy and every
+// shadow, so that a guest store to it through any mapping
+// faults into trap_and_emulate_wpfault() and drops the stale
+// decodes. Shadows filled later inherit the protection from
+// the base. userret flushes the TLB.
+static void dcache_protect(struct proc *p, uint64 va)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    pagetable_t pts[2] = { vs->og_pagetable, vs->pmp_pagetable };
+    uint64 gpa, pa = 0;
+    pte_t *pte;
 
-    // Fetch the instruction from virtual memory
-    if (copyin(p->pagetable, (char *)&instruction, addr, sizeof(uint32)) < 0)
+    if (dcache_gpa(p, va, PTE_X, &gpa) < 0)
+        return;
+    for (int i = 0; i < 2; i++)
+    {
+        // a copy-on-write page will be writable once copied.
+        pte = pts[i] ? walk(pts[i], gpa, 0) : 0;
+        if (pte && (*pte & PTE_V) && (*pte & (PTE_W | PTE_COW)))
+        {
+            *pte = (*pte & ~PTE_W) | PTE_WP;
+            pa = PTE2PA(*pte);
+        }
+    }
+    // shadows never map pages shared copy-on-write.
+    if (pa)
+        dcache_shadows(p, pa, leaf_protect);
+}
+
+// Handle a store page fault at va in VM process p. If the page
+// was write-protected by the decode cache, make it writable
+// again and invalidate the cached decodes in it.
+// Returns 0 if handled, -1 if this is a genuine fault.
+int trap_and_emulate_wpfault(struct proc *p, uint64 va)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    pagetable_t pts[2];
+    uint64 gpa, pa;
+    pte_t *pte;
+
+    if (vs == 0 || va >= MAXVA)
+        return -1;
+    if ((pte = walk(p->pagetable, va, 0)) == 0 || (*pte & PTE_WP) == 0)
+        return -1;
+    if (dcache_gpa(p, va, PTE_W, &gpa) < 0)
+        return -1;
+    pa = PTE2PA(*pte);
+    pts[0] = vs->og_pagetable;
+    pts[1] = vs->pmp_pagetable;
+    for (int i = 0; i < 2; i++)
+    {
+        // a copy-on-write page faults again, to be copied.
+        pte = pts[i] ? walk(pts[i], gpa, 0) : 0;
+        if (pte && (*pte & PTE_WP))
+            *pte = (*pte & ~PTE_WP) | ((*pte & PTE_COW) ? 0 : PTE_W);
+    }
+    dcache_shadows(p, pa, leaf_unprotect);
+
+    // cached pcs are guest-virtual: with paging on, the page
+    // may hold text at some other address than va.
+    if (vs->shadow_cur)
+    {
+        trap_and_emulate_flush(p);
+        return 0;
+    }
+    for (struct vm_insn *vi = vs->dcache; vi < &vs->dcache[NDCACHE]; vi++)
     {
-        panic("Failed to fetch instruction from virtual memory");
+        if (vi->insn != 0 && PGROUNDDOWN(vi->pc) == PGROUNDDOWN(va))
+            vi->insn = 0;
     }
+    return 0;
+}
+
+// Find the decoded instruction at guest address pc, in the
+// decode cache or by fetching and decoding it. With privonly,
+// instructions that cannot be privileged are neither decoded
+// nor cached. Returns 0 if there is no such instruction.
+static struct vm_insn* lookup(struct proc *p, uint64 pc, bool privonly)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct vm_insn *vi = &vs->dcache[(pc >> 1) & (NDCACHE - 1)];
+    uint32 instruction;
+    int len;
 
-    // Decode and handle the instruction (rest of the code unchanged)
-    uint32 op = instruction & 0x7F;            // Bits [6:0] (opcode)
-    uint32 rd = (instruction >> 7) & 0x1F;     // Bits [11:7] (destination register)
-    uint32 funct3 = (instruction >> 12) & 0x7; // Bits [14:12] (funct3)
-    uint32 rs1 = (instruction >> 15) & 0x1F;   // Bits [19:15] (source register)
-    uint32 uimm = (instruction >> 20) & 0xFFF; // Bits [31:20] (CSR address)
+    if (vi->insn != 0 && vi->pc == pc && vs->group == 0)
+    {
+        vs->dcache_hits++;
+        return vi;
+    }
 
-    // printf("(Decoded Instruction) addr: %p, opcode: 0x%x, rd: x%d, funct3: 0x%x, rs1: x%d, csr: 0x%x\n",addr, op, rd, funct3, rs1, uimm);
+    // Fetch the instruction from virtual memory
+    if ((len = trap_and_emulate_fetch(p, pc, &instruction)) < 0)
+        return 0;
+    if (vi->insn != 0 && vi->insn == instruction && vi->pc == pc)
+    {
+        // another vCPU may store to the text, and its pages
+        // are not write-protected: check that it has not.
+        vs->dcache_hits++;
+        return vi;
+    }
+    if (privonly && (instruction & 0x7F) != 0x73)
+        return 0;
+    // nor are csr instructions on CSRs the hypervisor does not
+    // implement, such as time, which scounteren lets the guest
+    // read itself.
+    if (privonly && ((instruction >> 12) & 0x7) != 0 &&
+        csrtab[(instruction >> 20) & 0xFFF].slot == VCSR_NONE)
+        return 0;
+    vs->dcache_misses++;
+    decode(vi, pc, instruction);
+    if (vs->group == 0)
+    {
+        dcache_protect(p, pc);
+        if (PGROUNDDOWN(pc + len - 1) != PGROUNDDOWN(pc))
+            dcache_protect(p, pc + len - 1);  // its second half
+    }
+    return vi;
+}
 
-    int current_mode = vm_state.priviledge_mode;
+// Append a record of the instruction vi, just emulated in
+// mode from, to p's trace ring if the trace verbosity asks
+// for it. The ring is allocated the first time it is needed.
+static void trace(struct proc *p, struct vm_insn *vi, int from)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct vmtrace_ring *tr = vs->trace;
+    struct vmtrace *r;
 
-    switch (op)
+    if (p->vmcfg.trace == VMTRACE_OFF)
+        return;
+    if (p->vmcfg.trace == VMTRACE_MODE && from == vs->priviledge_mode)
+        return;
+    if (tr == 0)
     {
-    case 0x73:
-        // only case we have to handle as for all instructions the op code is same
-        switch (funct3)
+        if ((tr = (struct vmtrace_ring *)kalloc()) == 0)
         {
-        case 0x0: // for ECALL, SRET & MRET
-            if (rd == 0x0 && rs1 == 0x0)
-            {
-                if (uimm == 0x0)
-                {
-                    // ECALL
-                    if (current_mode != U_MODE && current_mode != S_MODE)
-                    {
-                        return; // ECALL is not supported from M mode.
-                    }
-                    // ECALL
-                    emulate_ecall(current_mode, p);
-                    //printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n", addr, op, rd, funct3, rs1, uimm);
-                }
+            vs->tracedropped++;
+            return;
+        }
+        memset(tr, 0, PGSIZE);
+        vs->trace = tr;
+    }
+    if (tr->head - tr->tail == NVMTRACE)
+    {
+        vs->tracedropped++;
+        return;
+    }
 
-                else if (uimm == 0x102 && current_mode == S_MODE)
-                {
-                    // SRET
-                    /* Print the statement */
-                    printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n", addr, op, rd, funct3, rs1, uimm);
-                    emulate_sret(p);
-                }
-                else if (uimm == 0x302 && current_mode == M_MODE)
-                {
-                    // MRET
-                    printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n", addr, op, rd, funct3, rs1, uimm);
-                    emulate_mret(p);
-                }
-                else
-                {
-                    printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n", addr, op, rd, funct3, rs1, uimm);
-                    printf("Instruction is not correct.\n");
-                    setkilled(p);
-                    trap_and_emulate_init();
-                }
-            }
-            else
-            {
-                printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n", addr, op, rd, funct3, rs1, uimm);
-               printf("Instruction is not correct\n");
-                setkilled(p);
-                trap_and_emulate_init();
-            }
+    r = &tr->rec[tr->head % NVMTRACE];
+    r->cycle = r_time();
+    r->pc = vi->pc;
+    r->insn = vi->insn;
+    r->from = from;
+    r->to = vs->priviledge_mode;
 
-            break;
-        case 0x1: // for CSRW
-            printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n", addr, op, rd, funct3, rs1, uimm);
-            emulate_csrw(p, rd, rs1, uimm);
-            break;
-        case 0x2: // for CSR
-            printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n", addr, op, rd, funct3, rs1, uimm);
-            emulate_csrr(p, rd, rs1, uimm);
-            break;
-        default:
-            setkilled(p);
-            break;
+    // the record must be visible before the consumer sees head move.
+    __sync_synchronize();
+    tr->head++;
+}
+
+// The VMI_* class of decoded instruction vi.
+static int insn_class(struct vm_insn *vi)
+{
+    if (vi->fn == emulate_ecall)
+        return VMI_ECALL;
+    if (vi->fn == emulate_sret)
+        return VMI_SRET;
+    if (vi->fn == emulate_mret)
+        return VMI_MRET;
+    if (vi->fn == emulate_wfi)
+        return VMI_WFI;
+    if (vi->fn == emulate_sfence)
+        return VMI_SFENCE;
+    if (vi->fn == emulate_csr)
+        return ((vi->funct3 & 0x3) == 1 || vi->rs1 != 0) ? VMI_CSRW : VMI_CSRR;
+    return VMI_OTHER;
+}
+
+// Emulate the decoded instruction vi for p, and trace it.
+static void emulate(struct proc *p, struct vm_insn *vi)
+{
+    struct vm_stats *st = p->vm_state->stats;
+    int from = p->vm_state->priviledge_mode;
+    int class;
+
+    if (st)
+    {
+        class = insn_class(vi);
+        st->insn[class]++;
+        if (class == VMI_WFI)
+            st->exit_kind = VMX_WFI;
+        else if (class == VMI_CSRR || class == VMI_CSRW)
+            st->csr[csrtab[vi->imm].slot]++;
+    }
+    vi->fn(p, vi);
+    shadow_switch(p);
+    trace(p, vi, from);
+}
+
+// Copy up to n records from the trace ring of VM process pid
+// to user address dst, removing them from the ring.
+// Returns the number of records copied, or -1 if pid is not a
+// VM, or has exited and its ring is empty.
+int trap_and_emulate_trace(int pid, uint64 dst, int n)
+{
+    struct proc *p;
+    struct vmtrace_ring *tr;
+    struct vmtrace *buf;
+    int i, got = -1;
+
+    if ((buf = (struct vmtrace *)kalloc()) == 0)
+        return -1;
+    if (n > PGSIZE / sizeof(struct vmtrace))
+        n = PGSIZE / sizeof(struct vmtrace);
+
+    for (p = proc; p < &proc[NPROC]; p++)
+    {
+        // p->lock keeps freeproc() from releasing the ring under us.
+        acquire(&p->lock);
+        if (p->pid != pid || p->vm_state == 0)
+        {
+            release(&p->lock);
+            continue;
         }
+
+        got = 0;
+        if ((tr = p->vm_state->trace) != 0)
+        {
+            uint head = tr->head;
+            __sync_synchronize(); // read head before the records
+            for (i = 0; i < n && tr->tail + i != head; i++)
+                buf[i] = tr->rec[(tr->tail + i) % NVMTRACE];
+            __sync_synchronize(); // done with the records before freeing them
+            tr->tail += i;
+            got = i;
+        }
+        if (got == 0 && p->state == ZOMBIE)
+            got = -1;
+        release(&p->lock);
         break;
+    }
 
-    default:
+    if (got > 0 && copyout(myproc()->pagetable, dst, (char *)buf, got * sizeof(struct vmtrace)) < 0)
+        got = -1;
+    kfree((void *)buf);
+    return got;
+}
+
+void trap_and_emulate(void)
+{
+    /* Comes here when a VM tries to execute a supervisor instruction. */
+
+    struct proc *p = myproc();
+    struct vm_virtual_state *vs = p->vm_state;
+    struct vm_insn *vi;
+    uint64 start = r_time();
+    uint64 halted;
+
+    if (vs == 0)
+    {
+        // e.g. a fork() child that kept its vm- name
         setkilled(p);
-        panic("Unsupported opcode in trap_and_emulate()");
+        return;
     }
+    vs->exits++;
+    halted = vs->halted;
+
+    if ((vi = lookup(p, r_sepc(), false)) == 0)
+    {
+        printf("Failed to fetch instruction from virtual memory\n");
+        setkilled(p);
+        return;
+    }
+    emulate(p, vi);
+
+    // Guest trap handlers often run several privileged
+    // instructions back to back. Emulate those that follow
+    // in this exit too, instead of returning to the guest
+    // only for it to trap again, up to the exit budget.
+    // Stop once the guest has an interrupt to take, as after an
+    // xRET or a write to mstatus, mie or mip that enables one:
+    // vmtrap() delivers it before the next instruction runs.
+    int budget = p->vmcfg.exitbudget ? p->vmcfg.exitbudget : VMEXITBUDGET;
+    bool tos;
+    for (int n = 1; n < budget && !killed(p); n++)
+    {
+        vtimer_sync(vs);
+        if (intr_next(vs, &tos) >= 0)
+            break;
+        uint64 pc = p->trapframe->epc;
+        if (pc == vi->pc)
+            break; // the guest would spin on it
+        vi = lookup(p, pc, true);
+        if (vi == 0 || vi->fn == emulate_illegal || vi->fn == emulate_unsupported)
+            break; // an ordinary instruction; let the guest run it
+        vs->batched++;
+        emulate(p, vi);
+    }
+
+    // time the guest spent halted is not emulation overhead.
+    vs->cycles += r_time() - start - (vs->halted - halted);
 }
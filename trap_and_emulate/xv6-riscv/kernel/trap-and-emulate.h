@@ -0,0 +1,221 @@
+// Per-VM state for the trap-and-emulate hypervisor.
+// Each VM process owns one of these, hung off p->vm_state
+// in a page of its own (like p->trapframe), so that VMs on
+// different harts never share emulation state.
+
+#define M_MODE 2
+#define S_MODE 1
+#define U_MODE 0
+
+// Storage slots for the virtual CSRs, indexed through the
+// csrtab[] descriptor table in trap-and-emulate.c.
+enum {
+    VCSR_NONE,          // not an implemented CSR
+
+    // User trap setup and handling
+    VCSR_USTATUS, VCSR_UIE, VCSR_UTVEC,
+    VCSR_USCRATCH, VCSR_UEPC, VCSR_UCAUSE, VCSR_UTVAL, VCSR_UIP,
+
+    // Supervisor trap setup and handling
+    VCSR_SSTATUS, VCSR_SEDELEG, VCSR_SIDELEG, VCSR_SIE, VCSR_STVEC,
+    VCSR_SCOUNTEREN,
+    VCSR_SSCRATCH, VCSR_SEPC, VCSR_SCAUSE, VCSR_STVAL, VCSR_SIP,
+
+    // Supervisor page table register
+    VCSR_SATP,
+
+    // Machine information registers
+    VCSR_MVENDORID, VCSR_MARCHID, VCSR_MIMPID, VCSR_MHARTID,
+
+    // Machine trap setup and handling
+    VCSR_MSTATUS, VCSR_MISA, VCSR_MEDELEG, VCSR_MIDELEG, VCSR_MIE,
+    VCSR_MTVEC, VCSR_MCOUNTEREN,
+    VCSR_MSCRATCH, VCSR_MEPC, VCSR_MCAUSE, VCSR_MTVAL, VCSR_MIP,
+
+    // Machine physical memory protection
+    VCSR_PMPCFG0,
+    VCSR_PMPADDR0 = VCSR_PMPCFG0 + 16,
+
+    NVCSR = VCSR_PMPADDR0 + 64
+};
+
+struct proc;
+struct vmgroup;
+struct vmckpt;
+
+// A privileged instruction decoded by trap_and_emulate(),
+// cached by guest PC so that a guest trapping on the same
+// instruction again skips the fetch and decode.
+struct vm_insn
+{
+    uint64 pc;
+    uint32 insn;    // raw instruction; 0 (illegal) marks an empty slot
+    uchar len;      // its length in bytes: 2 if compressed, else 4
+    uchar rd;
+    uchar rs1;
+    uchar funct3;
+    ushort imm;     // bits [31:20]: CSR address or SYSTEM funct12
+    void (*fn)(struct proc *, struct vm_insn *); // emulation handler
+};
+
+#define NDCACHE 64  // decode cache entries per VM, power of 2
+
+// Trace ring of emulated instructions, in a page of its own,
+// allocated when tracing is first turned on. The VM's kernel
+// thread is the only producer and vmtrace() the only consumer,
+// so head and tail need no lock; they only ever increase.
+struct vmtrace_ring
+{
+    uint head;                 // next record to write
+    uint tail;                 // next record to read
+    struct vmtrace rec[];
+};
+
+#define NVMTRACE ((PGSIZE - sizeof(struct vmtrace_ring)) / sizeof(struct vmtrace))
+
+// A shadow page table, mapping guest-virtual addresses straight
+// to host pages so that the guest can run with its own paging
+// on. See shadow.c.
+struct shadow
+{
+    uint64 satp;               // guest satp (root and ASID) it shadows, 0 if free
+    pagetable_t root[2];       // for guest S-mode [0] and U-mode [1]
+    uint64 used;               // shadow_clock at last use, for LRU
+    bool superpages;           // filled from guest superpages
+};
+
+#define NSHADOW 4   // shadow page tables cached per VM
+
+// Virtual 16550 UART, see mmio.c.
+#define VUARTBUF 128    // bytes of output collected before a write
+
+struct vuart
+{
+    uchar ier, lcr, mcr, scr;
+    uchar dll, dlm;             // divisor latch
+    uint len;                   // bytes in buf
+    char buf[VUARTBUF];
+};
+
+// Guest RAM, in guest-physical memory; see vmmem.c.
+#define VMRAMBASE 0x80000000L
+#define VMDEFMEM  (4*1024*1024)     // default size
+#define VMMAXMEM  (1024*1024*1024)  // largest size
+
+// Bounds of the window, in timebase cycles, for which a VM
+// in wfi polls for an interrupt before it sleeps.
+#define VMHALTPOLLMIN 100   // 10us in qemu
+#define VMHALTPOLLMAX 2000  // 200us
+
+// Guest integer register x<r>, kept in the trapframe in
+// register number order from ra (x1). x0 reads as zero and
+// ignores writes.
+static inline uint64 getreg(struct proc *p, int r)
+{
+    return r == 0 ? 0 : (&p->trapframe->ra)[r - 1];
+}
+
+static inline void setreg(struct proc *p, int r, uint64 val)
+{
+    if (r != 0)
+        (&p->trapframe->ra)[r - 1] = val;
+}
+
+// Exit statistics, in a page of their own, reported by
+// vmstat(); see trap_and_emulate_exitstart().
+struct vm_stats
+{
+    uint64 start;              // when the VM was created
+    uint64 exit_start;         // when the current exit began, 0 outside one
+    int exit_kind;             // VMX_* of the current exit
+    uint64 exits;
+    uint64 cause[VMSTAT_NCAUSE];
+    uint64 insn[VMSTAT_NINSN];
+    uint64 csr[NVCSR];         // csr instructions by storage slot
+    uint64 hist[VMSTAT_NKIND][VMSTAT_NHIST];
+};
+
+struct vm_virtual_state
+{
+    // Virtual CSR file, indexed by VCSR_*
+    uint64 csr[NVCSR];
+
+    // The VM's other vCPUs, see vcpu.c
+    struct vmgroup *group;     // 0 if this is its only one
+    int msip_req;              // from another vCPU: 1 to clear msip, 2 to set it
+
+    // Privilege mode and page table setup
+    uint64 priviledge_mode;    // 0: U-mode, 1: S-mode, 2: M-mode
+    bool pmp_setup;            // Is PMP configured?
+    bool pmp_dirty;            // PMP changed since pmp_pagetable was built
+    pagetable_t pmp_pagetable; // PMP page table, see pmp.c
+    pagetable_t og_pagetable;  // Base page table, mapping guest-physical memory
+    uint64 memsize;            // bytes of guest RAM from VMRAMBASE
+
+    // Shadow page tables, cached by guest satp
+    struct shadow shadow[NSHADOW];
+    struct shadow *shadow_cur; // shadow in p->pagetable, or 0 for the base table
+    uint64 shadow_clock;
+    uint64 shadow_status;      // sstatus SUM and MXR that the shadows were filled with
+
+    // Decode cache, direct-mapped by guest PC. Text pages that
+    // hold cached instructions are write-protected (PTE_WP) so
+    // that guest stores to them invalidate their entries.
+    struct vm_insn dcache[NDCACHE];
+
+    struct vmtrace_ring *trace; // trace ring, or 0 if never traced
+    struct vm_stats *stats;    // exit statistics, or 0 if out of memory
+
+    // Virtual CLINT, see mmio.c. mtime is the host's time.
+    uint64 mtimecmp;
+    struct vuart uart;
+
+    // The device page last accessed, for mmio_fast().
+    pagetable_t mmio_pagetable; // page table in use at the time
+    uint64 mmio_va;            // guest-virtual page
+    uint64 mmio_pa;            // guest-physical page
+    int mmio_acc;              // PTE_R, PTE_W: accesses allowed; 0 for none
+
+    uint64 halt_poll;          // current wfi polling window, see halt()
+    bool idle;                 // waiting in wfi or HC_BALLOON, using no guest memory
+
+    uint64 cons_ring;          // guest-physical page of the console ring, or 0
+
+    uint64 stub;               // guest-physical page of patch stubs, or 0; see patch.c
+    uint64 stub_used;          // bytes of it in use
+
+    // Memory balloon, see hypercall.h: guest RAM pages that the
+    // guest has given back, by its own count.
+    uint64 balloon;
+    uint64 balloon_target;     // pages the host wants in it, set by vmctl()
+    uint64 balloon_seen;       // target as HC_BALLOON last returned it
+
+    // Checkpoint file, see vmckpt.c
+    struct vmckpt *ckpt;       // last checkpointed to or restored from, or 0
+    bool ckpt_pause;           // a checkpoint is being taken: park at the next exit
+    bool ckpt_parked;          // parked for it, in vmckpt_park()
+
+    // Statistics, reported by vminfo().
+    // Only the VM's own kernel thread writes these.
+    uint64 exits;              // traps into the hypervisor
+    uint64 emulated;           // privileged instructions emulated
+    uint64 dcache_hits;        // exits decoded from the cache
+    uint64 dcache_misses;      // exits that fetched and decoded
+    uint64 batched;            // emulated in a preceding instruction's exit
+    uint64 cycles;             // timebase cycles spent in trap_and_emulate()
+    uint64 tracedropped;       // trace records lost to a full ring
+    uint64 mmio;               // loads and stores emulated for virtual devices
+    uint64 mmiofast;           // of those, emulated by mmio_fast()
+    uint64 injected;           // virtual interrupts delivered
+    uint64 wfi;                // wfi instructions emulated
+    uint64 polled;             // wfi wakeups caught while polling
+    uint64 halted;             // timebase cycles spent waiting in wfi
+    uint64 ramfaults;          // guest RAM pages allocated on first touch
+    uint64 cowfaults;          // pages shared with a template copied on write
+    uint64 hypercalls;         // hypercalls served, see hypercall.c
+    uint64 consbytes;          // guest console output written
+    uint64 patched;            // csr instructions patched out of guest text
+    uint64 imageshared;        // image pages mapped from the image cache
+    uint64 ballooned;          // host pages freed by inflating the balloon
+    uint64 ckptloads;          // pages read from a checkpoint on first touch
+};
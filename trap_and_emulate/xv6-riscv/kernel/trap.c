@@ -9,6 +9,9 @@
 struct spinlock tickslock;
 uint ticks;
 
+// in start.c, shared with timervec.
+extern uint64 timer_scratch[NCPU][9];
+
 extern char trampoline[], uservec[], userret[];
 
 // in kernelvec.S, calls kerneltrap().
@@ -51,10 +54,6 @@ usertrap(void)
   p->trapframe->epc = r_sepc();
 
   if(r_scause() == 8){
-    if (strncmp(p->name, "vm-", 3) == 0) {
-      p->proc_te_vm = 1;
-      trap_and_emulate();
-    }
     // system call
     if(killed(p))
       exit(-1);
@@ -70,11 +69,7 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  } else if ((strncmp(p->name, "vm-", 3) == 0) && r_scause() != 12 && r_scause() != 13 && r_scause() != 15) {
-     p->proc_te_vm = 1;
-     trap_and_emulate();
-  }
-  else {
+  } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
     setkilled(p);
@@ -90,6 +85,85 @@ usertrap(void)
   usertrapret();
 }
 
+//
+// handle an exit from a VM's guest code: a privileged
+// instruction or ecall to emulate, a fault, or an interrupt.
+// usertrapret() installs this instead of usertrap() for VM
+// processes, so other processes never check for VMs and VM
+// exits skip the system call path.
+//
+void
+vmtrap(void)
+{
+  int which_dev = 0;
+  uint64 scause = r_scause();
+
+  if((r_sstatus() & SSTATUS_SPP) != 0)
+    panic("vmtrap: not from user mode");
+
+  // send interrupts and exceptions to kerneltrap(),
+  // since we're now in the kernel.
+  w_stvec((uint64)kernelvec);
+
+  struct proc *p = myproc();
+
+  // save guest program counter.
+  p->trapframe->epc = r_sepc();
+
+  trap_and_emulate_exitstart(p, scause);
+
+  // another access to the device page that the guest last
+  // accessed, such as a poll of the UART's status: emulate
+  // it and go straight back.
+  if((scause == 13 || scause == 15) && !killed(p) &&
+     mmio_fast(p, scause, r_stval()) == 0){
+    trap_and_emulate_exitend(p);
+    usertrapret();
+    return;
+  }
+
+  if((which_dev = devintr()) != 0){
+    // ok
+  } else if(scause == 12 || scause == 13 || scause == 15){
+    // a store to text in the decode cache, a fault on a
+    // shadow page table while the guest's paging is on, or
+    // while it is off, the first touch of a page of guest
+    // RAM or an access to a virtual device.
+    if((scause != 15 || trap_and_emulate_wpfault(p, r_stval()) < 0) &&
+       shadow_pagefault(p, scause, r_stval()) < 0){
+      printf("vmtrap(): unexpected scause %p pid=%d\n", scause, p->pid);
+      printf("          sepc=%p stval=%p\n", r_sepc(), r_stval());
+      setkilled(p);
+    }
+  } else {
+    trap_and_emulate();
+  }
+
+  // console output that the virtual UART collected.
+  mmio_flush(p);
+
+  // the VM stops as a whole, all of its vCPUs.
+  if(killed(p)){
+    vcpu_kill(p);
+    exit(-1);
+  }
+
+  // give up the CPU if this is a timer interrupt.
+  if(which_dev == 2)
+    yield();
+
+  // stop here, between two guest instructions, while the VM
+  // is being checkpointed.
+  vmckpt_park(p);
+
+  // on whichever CPU we now run, deliver a pending virtual
+  // interrupt and arm the guest's timer.
+  trap_and_emulate_intr(p);
+
+  trap_and_emulate_exitend(p);
+  usertrapret();
+}
+
 //
 // return to user space
 //
@@ -111,7 +185,7 @@ usertrapret(void)
   // the process next traps into the kernel.
   p->trapframe->kernel_satp = r_satp();         // kernel page table
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
-  p->trapframe->kernel_trap = (uint64)usertrap;
+  p->trapframe->kernel_trap = p->proc_te_vm ? (uint64)vmtrap : (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
 
   // set up the registers that trampoline.S's sret will use
@@ -176,6 +250,29 @@ clockintr()
   release(&tickslock);
 }
 
+// ask for a timer interrupt on this CPU at time deadline,
+// besides the periodic ones, for a VM's virtual timer. only
+// the earliest request is kept, so a VM that needs a later
+// one must ask again after the earlier one fires.
+// devintr() does not count these as ticks.
+void
+timerarm(uint64 deadline)
+{
+  push_off();
+  int id = cpuid();
+  uint64 *scratch = &timer_scratch[id][0];
+
+  // if timervec runs in between, it either sees the new
+  // deadline or has fired it; at worst the write below
+  // causes a spurious interrupt.
+  if(deadline < scratch[7]){
+    scratch[7] = deadline;
+    if(deadline < scratch[6])
+      *(uint64*)CLINT_MTIMECMP(id) = deadline;
+  }
+  pop_off();
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
 // returns 2 if timer interrupt,
@@ -210,17 +307,23 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // forwarded by timervec in kernelvec.S: a periodic tick,
+    // or a deadline from timerarm().
+    int id = cpuid();
+    int tick = __sync_lock_test_and_set(&timer_scratch[id][8], 0) != 0;
 
-    if(cpuid() == 0){
+    if(tick && id == 0){
       clockintr();
     }
+
+    // a VM waiting in wfi may have reached its deadline.
+    trap_and_emulate_timer();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    return tick ? 2 : 1;
   } else {
     return 0;
   }
@@ -0,0 +1,176 @@
+// Virtual CPUs.
+//
+// A VM with several vCPUs, asked for with vmctl(VMCTL_NCPU)
+// before exec, is a group of VM processes, one per vCPU. Each has
+// its own trapframe, privilege mode, CSR file, shadows and decode
+// cache, and the host schedules each like any process, so the
+// vCPUs of a VM run in parallel on as many harts as there are.
+// The guest tells them apart by mhartid.
+//
+// vCPU 0 is the process that exec'd the image; vcpu_start() makes
+// the others, as its children, starting at the same entry point
+// as real harts do. All map the same guest-physical memory: the
+// roots of their base page tables share the lower-level tables
+// below TRAPFRAME, so a mapping that one vCPU changes changes for
+// all. xv6 has no TLB shootdown, so those tables must not change
+// while the vCPUs run: a multi-vCPU VM gets all of its RAM at
+// exec, cannot be snapshotted, and its text is never patched or
+// write-protected for the decode cache.
+//
+// When one vCPU exits, the hypervisor kills the others, as a
+// machine stops as a whole. The last vCPU to be freed frees the
+// VM's memory.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+#define NVMGROUP (NPROC / 2)
+
+// The vCPUs of a VM that has more than one.
+struct vmgroup
+{
+    int refs;                  // vCPU processes not yet freed, 0 if unused
+    struct proc *cpu[NVCPU];   // by mhartid, 0 once freed
+};
+
+struct {
+    struct spinlock lock;
+    struct vmgroup g[NVMGROUP];
+} vcpus;
+
+void vcpu_init(void)
+{
+    initlock(&vcpus.lock, "vcpus");
+}
+
+// Start the other vCPUs of p, which has just exec'd a VM image
+// for which p->vmcfg asks for several. p becomes vCPU 0. If the
+// host runs out of processes or memory, the VM gets fewer.
+void vcpu_start(struct proc *p)
+{
+    struct vmgroup *g;
+    int n;
+
+    acquire(&vcpus.lock);
+    for (g = vcpus.g; g < &vcpus.g[NVMGROUP] && g->refs != 0; g++)
+        ;
+    if (g == &vcpus.g[NVMGROUP])
+    {
+        release(&vcpus.lock);
+        printf("vcpu: no free VM groups, running %s on one vCPU\n", p->name);
+        return;
+    }
+    memset(g, 0, sizeof(*g));
+    g->refs = 1;
+    g->cpu[0] = p;
+    p->vm_state->group = g;
+    release(&vcpus.lock);
+
+    for (n = 1; n < p->vmcfg.ncpu; n++)
+    {
+        if (vcpufork(p, n) < 0)
+        {
+            printf("vcpu: out of memory, running %s on %d vCPUs\n", p->name, n);
+            break;
+        }
+    }
+}
+
+// Make np, a new process, vCPU hartid of p's VM: point its base
+// page table at the VM's memory, and count it in the group.
+// Caller holds np->lock, and has given np its VM state.
+void vcpu_share(struct proc *np, struct proc *p, int hartid)
+{
+    struct vmgroup *g = p->vm_state->group;
+
+    // the root entries below TRAPFRAME's map the guest's
+    // memory; TRAPFRAME's, each vCPU's own trapframe.
+    for (int i = 0; i < PX(2, TRAPFRAME); i++)
+        np->pagetable[i] = p->pagetable[i];
+    np->vm_state->group = g;
+
+    acquire(&vcpus.lock);
+    g->refs++;
+    g->cpu[hartid] = np;
+    release(&vcpus.lock);
+}
+
+// p, a vCPU, is being freed. If other vCPUs of its VM have yet
+// to be, unhook the VM's memory from p's page table, so that
+// freeing p frees none of it.
+// Returns 1 if the others still use the memory, 0 if p is the
+// last, or the only, vCPU and must free it. Caller holds p->lock.
+int vcpu_free(struct proc *p)
+{
+    struct vmgroup *g;
+    int shared;
+
+    if (p->vm_state == 0 || (g = p->vm_state->group) == 0)
+        return 0;
+    acquire(&vcpus.lock);
+    for (int i = 0; i < NVCPU; i++)
+    {
+        if (g->cpu[i] == p)
+            g->cpu[i] = 0;
+    }
+    shared = --g->refs > 0;
+    release(&vcpus.lock);
+    p->vm_state->group = 0;
+
+    if (shared)
+    {
+        for (int i = 0; i < PX(2, TRAPFRAME); i++)
+            p->pagetable[i] = 0;
+    }
+    return shared;
+}
+
+// p, a vCPU, is exiting: kill the other vCPUs of its VM.
+void vcpu_kill(struct proc *p)
+{
+    struct vmgroup *g;
+    int pids[NVCPU], n = 0;
+
+    if (p->vm_state == 0 || (g = p->vm_state->group) == 0)
+        return;
+    // kill() takes each process's lock, which vcpu_free()'s
+    // caller holds when it takes vcpus.lock.
+    acquire(&vcpus.lock);
+    for (int i = 0; i < NVCPU; i++)
+    {
+        if (g->cpu[i] && g->cpu[i] != p)
+            pids[n++] = g->cpu[i]->pid;
+    }
+    release(&vcpus.lock);
+    for (int i = 0; i < n; i++)
+        kill(pids[i]);
+}
+
+// vCPU p wrote val to the CLINT msip register of hart hartid
+// of its VM. Raise or clear that vCPU's machine software
+// interrupt, which it picks up in trap_and_emulate_intr(), and
+// wake it if it is halted in wfi.
+void vcpu_msip(struct proc *p, int hartid, int val)
+{
+    struct vmgroup *g = p->vm_state->group;
+    struct proc *cp;
+
+    if (g == 0 || hartid < 0 || hartid >= NVCPU)
+        return;
+    acquire(&vcpus.lock);
+    // vcpu_free() clears cpu[] under the lock before the
+    // vCPU's state goes.
+    if ((cp = g->cpu[hartid]) != 0)
+        __sync_lock_test_and_set(&cp->vm_state->msip_req, val ? 2 : 1);
+    release(&vcpus.lock);
+    trap_and_emulate_timer(); // wakes the VMs halted in wfi
+}
@@ -27,6 +27,9 @@ kvmmake(void)
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for timerarm()
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
@@ -286,6 +289,20 @@ freewalk(pagetable_t pagetable)
   kfree((void*)pagetable);
 }
 
+// Free the page-table pages of a page table whose leaf
+// mappings refer to memory owned elsewhere, such as a VM's
+// shadow page table. The leaf pages are left alone.
+void
+uvmfreetable(pagetable_t pagetable)
+{
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0)
+      uvmfreetable((pagetable_t)PTE2PA(pte));
+  }
+  kfree((void*)pagetable);
+}
+
 // Free user memory pages,
 // then free page-table pages.
 void
@@ -0,0 +1,649 @@
+// VM checkpoints.
+//
+// vmcheckpoint() saves a running VM to a file: its registers,
+// its virtual CPU state and the pages of its memory that it has
+// touched. vmrestore() starts a new VM from the file, as
+// vmclone() does from a template.
+//
+// Each page of the VM keeps its place in the file, so that the
+// next checkpoint to the same file rewrites only the pages that
+// the VM dirtied since the last one. After a checkpoint, the
+// VM's writable pages are copy-on-write, as after vmsnapshot(),
+// and a page is dirty once vmmem_fault() has made it writable
+// again. The hypervisor itself writes to read-only pages only
+// through vmmem_private(), which marks them with PTE_D.
+//
+// A restored VM starts with none of its memory mapped, and
+// vmmem_fault() reads each page from the file the first time
+// the VM touches it, so a large VM resumes as fast as a small
+// one. The file is the VM's until it exits: no other VM may
+// checkpoint to it meanwhile.
+//
+// A checkpoint is taken between two of the VM's instructions:
+// vmcheckpoint() asks the VM to stop, and waits until it has
+// parked in vmckpt_park() on its way back to the guest.
+//
+// The file holds a header page, the index, and then pages of
+// guest memory in no particular order. The index has an entry
+// for each page of the image, then one for the page past it,
+// which may hold patch stubs (see patch.c), then one for each
+// page of RAM: the page of the file that holds it, or 0 if the
+// file does not, and its permissions. A checkpoint has to fit
+// in an xv6 file, MAXFILE blocks, so only VMs whose image and
+// RAM would fit even if every page were saved are checkpointed;
+// vmctl(VMCTL_MEMSIZE) makes a small enough guest. Nor is it
+// crash-safe: pages are rewritten in place before the index.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+extern struct proc proc[NPROC];
+
+#define VMCKPT_MAGIC 0x564d434b  // "VMCK"
+#define CKPT_WAIT    50          // ticks to wait for a VM to stop
+
+// Index entries: the page of the file, and PTE permissions.
+#define CKPT_ENTRY(fp, perm) (((uint64)(fp) << 10) | (perm))
+#define CKPT_PAGE(e)         ((e) >> 10)
+#define CKPT_PERM(e)         ((e) & 0x3FF)
+
+#define CKPTENT (PGSIZE / sizeof(uint64))  // index entries per page
+#define CKPTMAX (MAXFILE * BSIZE / PGSIZE) // pages in a checkpoint file
+
+// The first page of a checkpoint file.
+struct vmckpt_hdr
+{
+    uint magic;
+    uint nidx;                 // index pages, from page 1
+    uint64 npages;             // pages of the file in use
+    uint64 nimg;               // index entries for the image
+    uint64 sz;
+    uint64 memsize;
+    struct trapframe tf;
+    uint64 csr[NVCSR];
+    uint64 priviledge_mode;
+    uint64 pmp_setup;
+    uint64 shadow_status;
+    uint64 mtimecmp;
+    struct vuart uart;
+    uint64 cons_ring;
+    uint64 stub;
+    uint64 stub_used;
+    uint64 balloon;
+    struct vmconfig cfg;
+    char name[16];
+};
+
+#define NCKPTIDX ((PGSIZE - 6 * sizeof(uint64)) / sizeof(uint64 *))
+
+// A VM's checkpoint file, in a page of its own: the one it was
+// last checkpointed to, or restored from.
+struct vmckpt
+{
+    struct file *f;
+    struct vmckpt_hdr *hdr;    // from the file, until vmckpt_restore()
+    uint64 nimg;               // index entries for the image
+    uint64 nslots;             // index entries
+    uint64 nidx;               // index pages
+    uint64 npages;             // pages of the file in use
+    uint64 *idx[NCKPTIDX];     // the index, a page at a time
+};
+
+static uint64 *ckpt_entry(struct vmckpt *ck, uint64 s)
+{
+    return &ck->idx[s / CKPTENT][s % CKPTENT];
+}
+
+// The index entry for guest-physical page gpa, or -1 if none.
+static long ckpt_slot(struct vmckpt *ck, uint64 gpa)
+{
+    if (gpa < ck->nimg * PGSIZE)
+        return gpa / PGSIZE;
+    if (gpa >= VMRAMBASE && gpa - VMRAMBASE < (ck->nslots - ck->nimg) * PGSIZE)
+        return ck->nimg + (gpa - VMRAMBASE) / PGSIZE;
+    return -1;
+}
+
+static uint64 slot_gpa(struct vmckpt *ck, uint64 s)
+{
+    return s < ck->nimg ? s * PGSIZE : VMRAMBASE + (s - ck->nimg) * PGSIZE;
+}
+
+// Release ck, and its reference to the file.
+void vmckpt_close(struct vmckpt *ck)
+{
+    if (ck->f)
+        fileclose(ck->f);
+    if (ck->hdr)
+        kfree((void *)ck->hdr);
+    for (int i = 0; i < ck->nidx; i++)
+    {
+        if (ck->idx[i])
+            kfree((void *)ck->idx[i]);
+    }
+    kfree((void *)ck);
+}
+
+// A checkpoint of file f with an empty index of nslots entries,
+// the first nimg of them for the image.
+static struct vmckpt *ckpt_alloc(struct file *f, uint64 nimg, uint64 nslots)
+{
+    struct vmckpt *ck;
+
+    if ((ck = (struct vmckpt *)kalloc()) == 0)
+        return 0;
+    memset(ck, 0, sizeof(*ck));
+    ck->nimg = nimg;
+    ck->nslots = nslots;
+    ck->nidx = (nslots + CKPTENT - 1) / CKPTENT;
+    if (ck->nidx > NCKPTIDX)
+    {
+        ck->nidx = 0;
+        vmckpt_close(ck);
+        return 0;
+    }
+    for (int i = 0; i < ck->nidx; i++)
+    {
+        if ((ck->idx[i] = (uint64 *)kalloc()) == 0)
+        {
+            vmckpt_close(ck);
+            return 0;
+        }
+        memset(ck->idx[i], 0, PGSIZE);
+    }
+    ck->npages = 1 + ck->nidx;
+    ck->f = filedup(f);
+    return ck;
+}
+
+// Read n bytes at offset off of inode ip to kernel address dst.
+static int ckpt_read(struct inode *ip, uint64 off, void *dst, int n)
+{
+    int r;
+
+    ilock(ip);
+    r = readi(ip, 0, (uint64)dst, off, n);
+    iunlock(ip);
+    return r == n ? 0 : -1;
+}
+
+// Write n bytes at kernel address src to offset off of inode
+// ip, a few blocks per transaction, as filewrite() does.
+static int ckpt_write(struct inode *ip, uint64 off, void *src, int n)
+{
+    int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
+    int i = 0, n1, r;
+
+    while (i < n)
+    {
+        n1 = n - i < max ? n - i : max;
+        begin_op();
+        ilock(ip);
+        r = writei(ip, 0, (uint64)src + i, off + i, n1);
+        iunlock(ip);
+        end_op();
+        if (r != n1)
+            return -1;
+        i += n1;
+    }
+    return 0;
+}
+
+// Whether the page that pte maps changed since the checkpoint
+// that made it copy-on-write or clean.
+static bool ckpt_dirty(pte_t pte)
+{
+    return (pte & PTE_COW) == 0 && (pte & (PTE_W | PTE_WP | PTE_D));
+}
+
+// The permissions to restore the page that pte maps with.
+static uint64 ckpt_perm(pte_t pte)
+{
+    return (pte & (PTE_R | PTE_X | PTE_U)) | ((pte & (PTE_W | PTE_WP | PTE_COW)) ? PTE_W : 0);
+}
+
+// A page that is not writable is clean after a checkpoint.
+static int leaf_clean(pte_t *pte, uint64 va, void *arg)
+{
+    if ((*pte & (PTE_W | PTE_WP | PTE_COW)) == 0)
+        *pte &= ~PTE_D;
+    return 0;
+}
+
+// Whether a VM other than p was checkpointed to or restored
+// from inode ip.
+static bool ckpt_busy(struct proc *p, struct inode *ip)
+{
+    struct proc *q;
+    bool busy = false;
+
+    for (q = proc; q < &proc[NPROC]; q++)
+    {
+        if (q == p)
+            continue;
+        // q->lock keeps q from dropping its checkpoint under us.
+        acquire(&q->lock);
+        if (q->vm_state && q->vm_state->ckpt && q->vm_state->ckpt->f->ip == ip)
+            busy = true;
+        release(&q->lock);
+    }
+    return busy;
+}
+
+// Stop VM process pid for a checkpoint: ask it to park at its
+// next exit, and wait for it to.
+// Returns the process, parked, or 0 if it is not a VM that
+// can be checkpointed or did not stop in time.
+static struct proc *ckpt_stop(int pid)
+{
+    struct vm_virtual_state *vs;
+    struct proc *p;
+    uint64 nslots, npages;
+    bool parked;
+
+    for (p = proc; p < &proc[NPROC]; p++)
+    {
+        acquire(&p->lock);
+        if (p->pid == pid && p->state != UNUSED)
+            break;
+        release(&p->lock);
+    }
+    if (p == &proc[NPROC])
+        return 0;
+    vs = p->vm_state;
+    // a VM with several vCPUs is never checkpointed; see vcpu.c.
+    if (vs == 0 || vs->group || vs->ckpt_pause || p->state == ZOMBIE || p->killed)
+    {
+        release(&p->lock);
+        return 0;
+    }
+    // the header, the index, and every page.
+    nslots = PGROUNDUP(p->sz) / PGSIZE + 1 + vs->memsize / PGSIZE;
+    npages = 1 + (nslots + CKPTENT - 1) / CKPTENT + nslots;
+    if (npages > CKPTMAX)
+    {
+        release(&p->lock);
+        printf("vmckpt: VM %d is too large to checkpoint\n", pid);
+        return 0;
+    }
+    vs->ckpt_pause = true;
+    release(&p->lock);
+
+    // the VM parks within a tick, when its timer interrupt
+    // arrives, unless it is halted in wfi, which wakes then too.
+    for (int i = 0;; i++)
+    {
+        acquire(&p->lock);
+        if (p->pid != pid || p->vm_state != vs || p->state == ZOMBIE)
+        {
+            // it exited instead.
+            release(&p->lock);
+            return 0;
+        }
+        parked = vs->ckpt_parked;
+        if (parked || i == CKPT_WAIT)
+        {
+            if (!parked)
+                vs->ckpt_pause = false;
+            release(&p->lock);
+            return parked ? p : 0;
+        }
+        release(&p->lock);
+        acquire(&tickslock);
+        sleep(&ticks, &tickslock);
+        release(&tickslock);
+    }
+}
+
+// Called by a VM on its way back to the guest: if a checkpoint
+// of it is being taken, wait until it has been. A VM killed
+// meanwhile still waits, so that its memory stays put.
+void vmckpt_park(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    if (!vs->ckpt_pause)
+        return;
+    acquire(&tickslock);
+    vs->ckpt_parked = true;
+    // vmcheckpoint() does not wake us; the flag is checked each tick.
+    while (vs->ckpt_pause)
+        sleep(&ticks, &tickslock);
+    vs->ckpt_parked = false;
+    release(&tickslock);
+}
+
+// Write the pages of parked VM p that ck lacks, or that changed
+// since its last checkpoint, to ck's file. If from, the VM's
+// checkpoint until now, holds pages that the VM has not read
+// yet, copy them over, using page buf.
+// Returns the number of pages written, or -1.
+static int ckpt_pages(struct proc *p, struct vmckpt *ck, struct vmckpt *from, char *buf)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct inode *ip = ck->f->ip;
+    uint64 s, *e, old, fp, need = 0;
+    pte_t *pte;
+    int n = 0;
+
+    // fail before writing anything if the file would grow too large.
+    for (s = 0; s < ck->nslots; s++)
+    {
+        pte = walk(vs->og_pagetable, slot_gpa(ck, s), 0);
+        if (*ckpt_entry(ck, s) == 0 &&
+            ((pte && (*pte & PTE_V)) || (from && *ckpt_entry(from, s))))
+            need++;
+    }
+    if (ck->npages + need > CKPTMAX)
+        return -1;
+
+    for (s = 0; s < ck->nslots; s++)
+    {
+        e = ckpt_entry(ck, s);
+        pte = walk(vs->og_pagetable, slot_gpa(ck, s), 0);
+        if (pte && (*pte & PTE_V))
+        {
+            if (*e && !ckpt_dirty(*pte))
+                continue;
+            fp = *e ? CKPT_PAGE(*e) : ck->npages++;
+            if (ckpt_write(ip, fp * PGSIZE, (void *)PTE2PA(*pte), PGSIZE) < 0)
+                return -1;
+            *e = CKPT_ENTRY(fp, ckpt_perm(*pte));
+            n++;
+        }
+        else if (from && (old = *ckpt_entry(from, s)) != 0)
+        {
+            fp = ck->npages++;
+            if (ckpt_read(from->f->ip, CKPT_PAGE(old) * PGSIZE, buf, PGSIZE) < 0 ||
+                ckpt_write(ip, fp * PGSIZE, buf, PGSIZE) < 0)
+                return -1;
+            *e = CKPT_ENTRY(fp, CKPT_PERM(old));
+            n++;
+        }
+        // else the page is in the file, not yet read, or was never touched.
+    }
+    return n;
+}
+
+// Write ck's index, and a header with the state of parked VM p,
+// built in page buf, to ck's file.
+static int ckpt_header(struct proc *p, struct vmckpt *ck, char *buf)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct vmckpt_hdr *hdr = (struct vmckpt_hdr *)buf;
+    struct inode *ip = ck->f->ip;
+
+    for (int i = 0; i < ck->nidx; i++)
+    {
+        if (ckpt_write(ip, (1 + i) * PGSIZE, ck->idx[i], PGSIZE) < 0)
+            return -1;
+    }
+
+    memset(buf, 0, PGSIZE);
+    hdr->magic = VMCKPT_MAGIC;
+    hdr->nidx = ck->nidx;
+    hdr->npages = ck->npages;
+    hdr->nimg = ck->nimg;
+    hdr->sz = p->sz;
+    hdr->memsize = vs->memsize;
+    hdr->tf = *p->trapframe;
+    memmove(hdr->csr, vs->csr, sizeof(hdr->csr));
+    hdr->priviledge_mode = vs->priviledge_mode;
+    hdr->pmp_setup = vs->pmp_setup;
+    hdr->shadow_status = vs->shadow_status;
+    hdr->mtimecmp = vs->mtimecmp;
+    hdr->uart = vs->uart;
+    hdr->cons_ring = vs->cons_ring;
+    hdr->stub = vs->stub;
+    hdr->stub_used = vs->stub_used;
+    hdr->balloon = vs->balloon;
+    hdr->cfg = p->vmcfg;
+    safestrcpy(hdr->name, p->name, sizeof(hdr->name));
+    return ckpt_write(ip, 0, hdr, PGSIZE);
+}
+
+// Checkpoint parked VM p to file f: all of its pages if it was
+// last checkpointed to, or restored from, another file, else
+// only those that changed since.
+// Returns the number of pages written, or -1.
+static int ckpt_save(struct proc *p, struct file *f)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct vmckpt *old = vs->ckpt, *ck;
+    uint64 nimg = PGROUNDUP(p->sz) / PGSIZE + 1;
+    bool full = old == 0 || old->f->ip != f->ip;
+    uint size;
+    char *buf;
+    int n;
+
+    if (ckpt_busy(p, f->ip) || (buf = kalloc()) == 0)
+        return -1;
+    if (full)
+    {
+        if ((ck = ckpt_alloc(f, nimg, nimg + vs->memsize / PGSIZE)) == 0)
+        {
+            kfree(buf);
+            return -1;
+        }
+    }
+    else
+    {
+        // the file must still hold what the index says it does.
+        ck = old;
+        ilock(f->ip);
+        size = f->ip->size;
+        iunlock(f->ip);
+        if (size < ck->npages * PGSIZE)
+        {
+            kfree(buf);
+            return -1;
+        }
+    }
+
+    if ((n = ckpt_pages(p, ck, full ? old : 0, buf)) < 0 || ckpt_header(p, ck, buf) < 0)
+    {
+        kfree(buf);
+        if (full)
+            vmckpt_close(ck);
+        return -1;
+    }
+    kfree(buf);
+    if (full)
+    {
+        acquire(&p->lock);
+        vs->ckpt = ck;
+        release(&p->lock);
+        if (old)
+            vmckpt_close(old);
+    }
+
+    // track the pages the VM dirties from here on.
+    vmmem_protect(p);
+    vmmem_leaves(vs->og_pagetable, 2, 0, leaf_clean, 0);
+    return n;
+}
+
+// Checkpoint VM process pid to the file open as the caller's
+// fd. Returns the number of pages written, or -1.
+int vmckpt_save(int pid, int fd)
+{
+    struct file *f;
+    struct proc *p;
+    int n;
+
+    if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0 ||
+        f->type != FD_INODE || !f->writable)
+        return -1;
+    if ((p = ckpt_stop(pid)) == 0)
+        return -1;
+    n = ckpt_save(p, f);
+    acquire(&p->lock);
+    p->vm_state->ckpt_pause = false;
+    release(&p->lock);
+    return n;
+}
+
+// Read the header and index of the checkpoint in the file open
+// as the caller's fd, for vmckpt_restore().
+// Returns the checkpoint, or 0 if there is none.
+struct vmckpt *vmckpt_open(int fd)
+{
+    struct vmckpt_hdr *hdr;
+    struct vmckpt *ck;
+    struct file *f;
+
+    if (fd < 0 || fd >= NOFILE || (f = myproc()->ofile[fd]) == 0 ||
+        f->type != FD_INODE || !f->readable)
+        return 0;
+    if ((hdr = (struct vmckpt_hdr *)kalloc()) == 0)
+        return 0;
+    if (ckpt_read(f->ip, 0, hdr, sizeof(*hdr)) < 0 || hdr->magic != VMCKPT_MAGIC ||
+        hdr->memsize == 0 || hdr->memsize > VMMAXMEM || hdr->memsize % PGSIZE != 0 ||
+        hdr->sz >= VMRAMBASE || hdr->nimg != PGROUNDUP(hdr->sz) / PGSIZE + 1 ||
+        (ck = ckpt_alloc(f, hdr->nimg, hdr->nimg + hdr->memsize / PGSIZE)) == 0)
+    {
+        kfree((void *)hdr);
+        return 0;
+    }
+    ck->hdr = hdr;
+    if (hdr->nidx != ck->nidx || hdr->npages < ck->npages)
+        goto bad;
+    for (int i = 0; i < ck->nidx; i++)
+    {
+        if (ckpt_read(f->ip, (1 + i) * PGSIZE, ck->idx[i], PGSIZE) < 0)
+            goto bad;
+    }
+    ck->npages = hdr->npages;
+    return ck;
+
+bad:
+    vmckpt_close(ck);
+    return 0;
+}
+
+// Make np, a new process, a VM running from checkpoint ck, as
+// vmmem_clone() does from a template: copy its registers and
+// virtual CPU state. Its pages stay in the file until it
+// touches them. On success, ck is np's. Caller holds np->lock.
+// Returns 0 on success, -1 if out of memory.
+int vmckpt_restore(struct proc *np, struct vmckpt *ck)
+{
+    struct vmckpt_hdr *hdr = ck->hdr;
+    struct vm_virtual_state *tvs;
+    int r;
+
+    if ((tvs = (struct vm_virtual_state *)kalloc()) == 0)
+        return -1;
+    memset(tvs, 0, sizeof(*tvs));
+    memmove(tvs->csr, hdr->csr, sizeof(tvs->csr));
+    tvs->priviledge_mode = hdr->priviledge_mode;
+    tvs->pmp_setup = hdr->pmp_setup;
+    tvs->memsize = hdr->memsize;
+    tvs->shadow_status = hdr->shadow_status;
+    tvs->mtimecmp = hdr->mtimecmp;
+    tvs->uart = hdr->uart;
+    tvs->halt_poll = VMHALTPOLLMIN;
+    tvs->cons_ring = hdr->cons_ring;
+    tvs->stub = hdr->stub;
+    tvs->stub_used = hdr->stub_used;
+    tvs->balloon = hdr->balloon;
+    r = trap_and_emulate_vmclone(np, tvs);
+    kfree((void *)tvs);
+    if (r < 0)
+        return -1;
+
+    np->sz = hdr->sz;
+    *np->trapframe = hdr->tf;
+    np->proc_te_vm = 1;
+    // the saver's console fd means nothing to np, and a VM
+    // with several vCPUs is never checkpointed.
+    np->vmcfg = hdr->cfg;
+    np->vmcfg.consfd = -1;
+    np->vmcfg.ncpu = 0;
+    safestrcpy(np->name, hdr->name, sizeof(np->name));
+    kfree((void *)hdr);
+    ck->hdr = 0;
+    np->vm_state->ckpt = ck;
+    return 0;
+}
+
+// Map the page holding guest-physical address gpa, which the
+// guest stores to if write, from p's checkpoint file, clean
+// until the guest stores to it. Called by vmmem_fault().
+// Returns 0 on success, 1 if the file does not hold the page,
+// or -1 if it cannot be read, or there is no memory for it.
+int vmckpt_fault(struct proc *p, uint64 gpa, int write)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct vmckpt *ck = vs->ckpt;
+    uint64 e, fp, perm;
+    long s;
+    char *mem;
+
+    if ((s = ckpt_slot(ck, gpa)) < 0 || (e = *ckpt_entry(ck, s)) == 0)
+        return 1;
+    fp = CKPT_PAGE(e);
+    perm = CKPT_PERM(e);
+    if (fp <= ck->nidx || fp >= ck->npages || (mem = kalloc()) == 0)
+        return -1;
+    if (ckpt_read(ck->f->ip, fp * PGSIZE, mem, PGSIZE) < 0)
+    {
+        printf("vmckpt: cannot read page %p\n", gpa);
+        kfree(mem);
+        return -1;
+    }
+    if ((perm & PTE_W) && !write)
+        perm = (perm & ~PTE_W) | PTE_COW;
+    if (mappages(vs->og_pagetable, gpa, PGSIZE, (uint64)mem, perm) < 0)
+    {
+        kfree(mem);
+        return -1;
+    }
+    vs->ckptloads++;
+    // if this fails, the page stays in the base table.
+    return pmp_map(p, gpa) < 0 ? -1 : 0;
+}
+
+// The guest gave npages pages of RAM from base back to the
+// balloon: they read as zeroes from now on, not as they were
+// in p's checkpoint file.
+void vmckpt_forget(struct proc *p, uint64 base, uint64 npages)
+{
+    struct vmckpt *ck = p->vm_state->ckpt;
+    long s;
+
+    if (ck == 0)
+        return;
+    for (uint64 a = base; a < base + npages * PGSIZE; a += PGSIZE)
+    {
+        if ((s = ckpt_slot(ck, a)) >= 0)
+            *ckpt_entry(ck, s) = 0;
+    }
+}
+
+// p is exiting: release its checkpoint file.
+void vmckpt_exit(struct proc *p)
+{
+    struct vmckpt *ck;
+
+    if (p->vm_state == 0)
+        return;
+    acquire(&p->lock);
+    ck = p->vm_state->ckpt;
+    p->vm_state->ckpt = 0;
+    release(&p->lock);
+    if (ck)
+        vmckpt_close(ck);
+}
@@ -0,0 +1,214 @@
+// Shared VM images.
+//
+// exec() loads a VM's image into guest-physical memory below
+// VMRAMBASE. Many VMs usually run the same image, whose text and
+// read-only data no guest can store to, so exec() maps those
+// segments from a cache of pages read from the file once, rather
+// than loading a copy for each VM; what a VM has to itself is its
+// writable data, the RAM it touches, and its trapframe. kalloc.c
+// counts the references to each page, so a cached page lives on
+// while VMs map it, after its cache entry is gone.
+//
+// The hypervisor writes to guest text only through
+// vmmem_private(), which copies a shared page first. A cache
+// entry holds a reference to its file's inode, and the file
+// system drops the entry when the file is written, truncated or
+// unlinked, so exec() never maps stale pages.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "elf.h"
+#include "defs.h"
+
+#define NVMIMAGE 8                          // segments cached
+#define VMIMAGEMAX (PGSIZE / sizeof(uint64)) // pages per segment
+
+// A read-only segment of a VM image.
+struct vmimage
+{
+    struct inode *ip;   // file, held; 0 if unused
+    uint64 off;         // segment's offset in the file
+    uint64 filesz;
+    uint64 memsz;
+    uint64 *pages;      // a page of addresses of its pages
+    int valid;          // pages loaded
+    uint used;          // vmimages.clock when last mapped
+};
+
+struct
+{
+    struct spinlock lock;
+    uint clock;
+    struct vmimage img[NVMIMAGE];
+} vmimages;
+
+void vmimage_init(void)
+{
+    initlock(&vmimages.lock, "vmimages");
+}
+
+// Drop the cache's references to n pages, the page listing
+// them, and inode ip. Caller holds no spinlocks.
+static void image_drop(struct inode *ip, uint64 *pages, int n)
+{
+    for (int i = 0; i < n; i++)
+        kfree((void *)pages[i]);
+    kfree((void *)pages);
+    iput(ip);
+}
+
+// Read segment ph of ip into n fresh pages, zero-filled past
+// the end of its file contents.
+// Returns a page listing them, or 0 on failure.
+static uint64 *image_load(struct inode *ip, struct proghdr *ph, int n)
+{
+    uint64 *pages;
+    uint64 off;
+    char *mem;
+    uint m;
+    int i;
+
+    if ((pages = (uint64 *)kalloc()) == 0)
+        return 0;
+    for (i = 0; i < n; i++)
+    {
+        if ((mem = kalloc()) == 0)
+            goto bad;
+        memset(mem, 0, PGSIZE);
+        pages[i] = (uint64)mem;
+        off = (uint64)i * PGSIZE;
+        if (off < ph->filesz)
+        {
+            m = ph->filesz - off < PGSIZE ? ph->filesz - off : PGSIZE;
+            if (readi(ip, 0, (uint64)mem, ph->off + off, m) != m)
+            {
+                i++;
+                goto bad;
+            }
+        }
+    }
+    return pages;
+
+bad:
+    while (i-- > 0)
+        kfree((void *)pages[i]);
+    kfree((void *)pages);
+    return 0;
+}
+
+// Map read-only segment ph of VM image ip in pagetable, from
+// the cache, reading it into the cache first if it is not
+// there. Caller holds ip->lock, so no other exec() loads the
+// same segment meanwhile.
+// Returns the number of pages mapped, or -1 if the segment
+// must be loaded privately instead.
+int vmimage_map(pagetable_t pagetable, struct inode *ip, struct proghdr *ph)
+{
+    struct vmimage *im, *victim = 0;
+    struct inode *oip = 0;
+    uint64 *opages = 0;
+    int n, on = 0, perm;
+
+    n = PGROUNDUP(ph->memsz) / PGSIZE;
+    if (n > VMIMAGEMAX)
+        return -1;
+
+    acquire(&vmimages.lock);
+    for (im = vmimages.img; im < &vmimages.img[NVMIMAGE]; im++)
+    {
+        if (im->ip == ip && im->off == ph->off &&
+            im->filesz == ph->filesz && im->memsz == ph->memsz)
+            break;
+        // a slot being loaded is in use by its loader.
+        if (im->ip == 0 || im->valid)
+        {
+            if (victim == 0 || (victim->ip && (im->ip == 0 || im->used < victim->used)))
+                victim = im;
+        }
+    }
+    if (im == &vmimages.img[NVMIMAGE])
+    {
+        // not cached: evict the least recently used segment.
+        if ((im = victim) == 0)
+        {
+            release(&vmimages.lock);
+            return -1;
+        }
+        if ((oip = im->ip) != 0)
+        {
+            opages = im->pages;
+            on = PGROUNDUP(im->memsz) / PGSIZE;
+        }
+        im->ip = ip;
+        im->off = ph->off;
+        im->filesz = ph->filesz;
+        im->memsz = ph->memsz;
+        im->valid = 0;
+        release(&vmimages.lock);
+
+        if (oip)
+            image_drop(oip, opages, on);
+        idup(ip);
+        im->pages = image_load(ip, ph, n);
+
+        acquire(&vmimages.lock);
+        if (im->pages == 0)
+        {
+            im->ip = 0;
+            release(&vmimages.lock);
+            iput(ip);
+            return -1;
+        }
+        im->valid = 1;
+        ip->vmimage = 1;
+    }
+    im->used = ++vmimages.clock;
+
+    // the cache keeps its own references while the lock is held.
+    perm = PTE_R | PTE_U | ((ph->flags & ELF_PROG_FLAG_EXEC) ? PTE_X : 0);
+    for (int i = 0; i < n; i++)
+    {
+        if (mappages(pagetable, ph->vaddr + (uint64)i * PGSIZE, PGSIZE, im->pages[i], perm) < 0)
+        {
+            uvmunmap(pagetable, ph->vaddr, i, 1);
+            release(&vmimages.lock);
+            return -1;
+        }
+        kdup((void *)im->pages[i]);
+    }
+    release(&vmimages.lock);
+    return n;
+}
+
+// ip, which may be a cached VM image, is being written,
+// truncated or unlinked: drop it from the cache. The caller
+// holds ip->lock and a reference of its own, so the cache's
+// reference is never the last.
+void vmimage_forget(struct inode *ip)
+{
+    struct vmimage *im;
+    uint64 *pages;
+    int n;
+
+    for (im = vmimages.img; im < &vmimages.img[NVMIMAGE]; im++)
+    {
+        acquire(&vmimages.lock);
+        if (im->ip != ip || !im->valid)
+        {
+            release(&vmimages.lock);
+            continue;
+        }
+        pages = im->pages;
+        n = PGROUNDUP(im->memsz) / PGSIZE;
+        memset(im, 0, sizeof(*im));
+        release(&vmimages.lock);
+        image_drop(ip, pages, n);
+    }
+    ip->vmimage = 0;
+}
@@ -0,0 +1,107 @@
+// VM counters, as reported by the vminfo() system call,
+// and settings that the vmctl() system call can change.
+struct vminfo {
+  int pid;          // VM process, or 0 for system-wide totals
+  int nvm;          // number of running VMs (system-wide only)
+  uint64 exits;     // traps into the hypervisor
+  uint64 emulated;  // privileged instructions emulated
+  uint64 dcache_hits;    // exits served by the decode cache
+  uint64 dcache_misses;  // exits that fetched and decoded the instruction
+  uint64 batched;   // instructions emulated without an exit of their own
+  uint64 cycles;    // timebase cycles spent emulating
+  uint64 tracedropped;  // trace records lost to a full ring
+  uint64 mmio;      // loads and stores emulated for virtual devices
+  uint64 mmiofast;  // of those, emulated without a full exit
+  uint64 injected;  // virtual interrupts delivered
+  uint64 wfi;       // wfi instructions emulated
+  uint64 polled;    // wfi wakeups caught while polling, without sleeping
+  uint64 halted;    // timebase cycles spent waiting in wfi
+  uint64 ramfaults; // guest RAM pages allocated on first touch
+  uint64 cowfaults; // pages shared with a VM template copied on write
+  uint64 hypercalls; // hypercalls from the guest kernel
+  uint64 consbytes; // guest console output written, see hypercall.h
+  uint64 patched;   // guest reads of constant CSRs patched to run without an exit
+  uint64 imageshared; // image pages mapped from the shared image cache at exec
+  uint64 balloon;   // guest RAM pages in balloons now (running VMs only)
+  uint64 ballooned; // host pages freed by inflating balloons
+  uint64 ckptloads; // pages of restored VMs read from their checkpoint on first touch
+};
+
+// Exit statistics of a VM, as reported by the vmstat() system
+// call. Each exit is timed from its trap to usertrapret(), in
+// timebase cycles, into a log2 histogram for its kind: bucket
+// i counts exits that took from 2^i to 2^(i+1)-1 cycles.
+#define VMSTAT_NCAUSE 32  // scause: exceptions 0-15, then interrupts 0-15
+#define VMSTAT_NCSR   128 // most CSRs reported
+#define VMSTAT_NHIST  32  // histogram buckets
+
+// emulated instruction classes
+#define VMI_ECALL   0
+#define VMI_SRET    1
+#define VMI_MRET    2
+#define VMI_CSRR    3     // csr instruction that only reads
+#define VMI_CSRW    4     // csr instruction that writes
+#define VMI_WFI     5
+#define VMI_SFENCE  6
+#define VMI_OTHER   7     // illegal or unsupported
+#define VMSTAT_NINSN 8
+
+// exit kinds, one latency histogram each
+#define VMX_INSN    0     // privileged instructions emulated
+#define VMX_WFI     1     // includes the time halted
+#define VMX_FAULT   2     // page faults: shadow fills, RAM, copy-on-write, mmio
+#define VMX_INTR    3     // host interrupts, including time yielded
+#define VMSTAT_NKIND 4
+
+struct vmstatcsr {
+  uint csr;         // CSR address
+  uint64 n;         // instructions emulated that accessed it; 0 after the last
+};
+
+struct vmstat {
+  int pid;          // VM process, or 0 for all VMs, exited ones too
+  uint64 time;      // timebase cycles that the VM has existed; for all, the sum
+  uint64 exits;
+  uint64 cause[VMSTAT_NCAUSE];         // exits by scause
+  uint64 insn[VMSTAT_NINSN];           // instructions emulated by class
+  struct vmstatcsr csr[VMSTAT_NCSR];   // csr instructions by CSR
+  uint64 hist[VMSTAT_NKIND][VMSTAT_NHIST];
+};
+
+// One emulated instruction, as recorded in a VM's trace ring
+// and returned by the vmtrace() system call.
+struct vmtrace {
+  uint64 cycle;     // timebase cycle at which it was emulated
+  uint64 pc;        // guest address of the instruction
+  uint32 insn;      // the instruction
+  uchar from;       // privilege mode before it (0 U, 1 S, 2 M)
+  uchar to;         // privilege mode after it
+};
+
+// vmctl() operations
+#define VMCTL_EXITBUDGET 1  // privileged instructions emulated per exit
+#define VMCTL_TRACE      2  // trace verbosity, VMTRACE_*
+#define VMCTL_MEMSIZE    3  // guest RAM in bytes, a multiple of 4096; at exec
+#define VMCTL_CONSFD     4  // fd for guest console output, -1 for the console
+#define VMCTL_PATCH      5  // 1 (the default) to patch guest text, 0 not to
+#define VMCTL_NCPU       6  // vCPUs, 1 to NVCPU; at exec
+#define VMCTL_BALLOON    7  // pages a running VM should give back; see hypercall.h
+
+#define NVCPU 8             // most vCPUs per VM
+
+// trace verbosity
+#define VMTRACE_OFF   0     // record nothing
+#define VMTRACE_MODE  1     // record privilege mode changes
+#define VMTRACE_ALL   2     // record every emulated instruction
+
+// VM template slots, for vmsnapshot() and vmclone()
+#define NVMTEMPLATE 4
+
+// Same-page merging, as reported by the vmmerge() system call.
+struct vmmergestat {
+  uint64 scanned;   // guest pages hashed
+  uint64 merged;    // guest pages merged into a shared copy
+  uint64 passes;    // full passes over all VMs' memory
+  uint64 shared;    // shared copies now mapped by more than one guest page
+  uint64 saved;     // host pages that sharing them saves now
+};
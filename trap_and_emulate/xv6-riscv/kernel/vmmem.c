@@ -0,0 +1,413 @@
+// Guest RAM.
+//
+// A VM's RAM is vs->memsize bytes of guest-physical memory from
+// VMRAMBASE, sized by vmctl(VMCTL_MEMSIZE) before exec. exec()
+// maps none of it: vmmem_fault() allocates and zeroes each page
+// the first time the guest touches it, so a VM costs host memory
+// only for the pages it uses, and starts in the same time
+// whatever the size of its RAM. (A VM with several vCPUs gets
+// all of it at exec instead; see vcpu.c.)
+//
+// Guest RAM pages are readable and writable, but not executable.
+//
+// vmsnapshot() freezes a VM that is not running as a template:
+// a page table sharing all of its pages, and a copy of its
+// registers and virtual CPU state. vmclone() starts a new VM
+// from a template, sharing its pages too. Pages that were
+// writable are shared copy-on-write (PTE_COW) by the VM and
+// its clones, and vmmem_fault() copies one the first time a
+// VM stores to it; kalloc.c counts the references to each.
+//
+// A VM restored from a checkpoint reads its pages from the
+// checkpoint file instead, on first touch; see vmckpt.c.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+extern struct proc proc[NPROC];
+
+// VM templates, made by vmsnapshot().
+struct vmtemplate
+{
+    int used;
+    pagetable_t pagetable;          // shares the VM's pages, none writable
+    uint64 sz;
+    struct trapframe tf;
+    struct vm_virtual_state *vs;    // copy of the VM's, in a page of its own
+    struct vmconfig cfg;
+    char name[16];
+};
+
+struct
+{
+    struct spinlock lock;
+    struct vmtemplate t[NVMTEMPLATE];
+} vmtemplates;
+
+void vmmem_init(void)
+{
+    initlock(&vmtemplates.lock, "vmtemplates");
+}
+
+// Handle a fault on the page holding guest-physical address
+// gpa, which the guest stores to if write. Back a page of guest
+// RAM that the guest has not touched before with a zeroed page,
+// or give the VM its own copy of a page it shares copy-on-write.
+// Returns 0 on success, or -1 if the fault is a genuine one, or
+// there is no memory to handle it.
+int vmmem_fault(struct proc *p, uint64 gpa, int write)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 pa, flags;
+    pte_t *pte;
+    char *mem;
+    int r;
+
+    if (vs == 0 || gpa >= VMRAMBASE + vs->memsize)
+        return -1;
+    gpa = PGROUNDDOWN(gpa);
+    if ((pte = walk(vs->og_pagetable, gpa, 0)) != 0 && (*pte & PTE_V))
+    {
+        if (!write || (*pte & PTE_COW) == 0)
+            return -1;
+        pa = PTE2PA(*pte);
+        flags = PTE_FLAGS(*pte) & ~PTE_COW;
+        // a page the decode cache protects stays protected.
+        if ((flags & PTE_WP) == 0)
+            flags |= PTE_W;
+        if (krefs((void *)pa) > 1)
+        {
+            // still shared: copy it.
+            if ((mem = kalloc()) == 0)
+                goto oom;
+            memmove(mem, (char *)pa, PGSIZE);
+            kfree((void *)pa);
+            pa = (uint64)mem;
+        }
+        *pte = PA2PTE(pa) | flags;
+        if (pmp_map(p, gpa) < 0)
+            goto oom;
+        vs->cowfaults++;
+        return 0;
+    }
+    if (vs->ckpt && (r = vmckpt_fault(p, gpa, write)) <= 0)
+        return r;
+    if (gpa < VMRAMBASE)
+        return -1;
+
+    if ((mem = kalloc()) == 0)
+        goto oom;
+    memset(mem, 0, PGSIZE);
+    if (mappages(vs->og_pagetable, gpa, PGSIZE, (uint64)mem, PTE_R | PTE_W | PTE_U) < 0)
+    {
+        kfree(mem);
+        goto oom;
+    }
+    // if this fails, the page stays in the base table.
+    if (pmp_map(p, gpa) < 0)
+        goto oom;
+    vs->ramfaults++;
+    return 0;
+
+oom:
+    printf("vmmem: out of memory\n");
+    return -1;
+}
+
+// Make the page holding guest-physical address gpa p's own,
+// copying it if p shares it with a template or its clones, so
+// that the hypervisor may write to it, and return it. Unlike
+// vmmem_fault(), this also copies pages that are shared because
+// nobody may store to them, such as guest text; the shadows,
+// which may map the shared copy, are dropped. The page is
+// marked dirty (PTE_D) for the VM's next checkpoint.
+// Returns 0 if nothing is mapped there, or out of memory.
+char *vmmem_private(struct proc *p, uint64 gpa)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 pa;
+    pte_t *pte;
+    char *mem;
+
+    gpa = PGROUNDDOWN(gpa);
+    if ((pte = walk(vs->og_pagetable, gpa, 0)) == 0 || (*pte & PTE_V) == 0)
+        return 0;
+    if (*pte & PTE_COW)
+        return vmmem_fault(p, gpa, 1) < 0 ? 0 : (char *)PTE2PA(*pte);
+
+    pa = PTE2PA(*pte);
+    if (krefs((void *)pa) > 1)
+    {
+        if ((mem = kalloc()) == 0)
+            return 0;
+        memmove(mem, (char *)pa, PGSIZE);
+        kfree((void *)pa);
+        *pte = PA2PTE((uint64)mem) | PTE_FLAGS(*pte);
+        shadow_flush(p);
+        if (pmp_map(p, gpa) < 0)
+            return 0;
+        pa = (uint64)mem;
+    }
+    *pte |= PTE_D;
+    return (char *)pa;
+}
+
+// Back all of p's guest RAM with pages now, rather than as the
+// guest touches them.
+// Returns 0 on success, -1 if out of memory.
+int vmmem_populate(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+
+    for (uint64 a = VMRAMBASE; a < VMRAMBASE + vs->memsize; a += PGSIZE)
+    {
+        if (vmmem_fault(p, a, 1) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Call fn on each leaf PTE below TRAPFRAME in the subtree tbl
+// of a page table, which maps addresses from va at level,
+// stopping at the first that fails.
+// Returns 0 on success, -1 if fn failed.
+int vmmem_leaves(pagetable_t tbl, int level, uint64 va,
+                 int (*fn)(pte_t *, uint64, void *), void *arg)
+{
+    uint64 a;
+
+    for (int i = 0; i < 512; i++)
+    {
+        a = va + ((uint64)i << PXSHIFT(level));
+        if (a >= TRAPFRAME)
+            break;
+        if ((tbl[i] & PTE_V) == 0)
+            continue;
+        if ((tbl[i] & (PTE_R | PTE_W | PTE_X)) == 0)
+        {
+            // this PTE points to a lower-level page table.
+            if (vmmem_leaves((pagetable_t)PTE2PA(tbl[i]), level - 1, a, fn, arg) < 0)
+                return -1;
+        }
+        else if (fn(&tbl[i], a, arg) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Drop a page table's reference to a page, and unmap it.
+static int leaf_unmap(pte_t *pte, uint64 va, void *arg)
+{
+    kfree((void *)PTE2PA(*pte));
+    *pte = 0;
+    return 0;
+}
+
+// Map a page in page table arg as well, copy-on-write if it
+// is or will be writable.
+static int leaf_share(pte_t *pte, uint64 va, void *arg)
+{
+    uint64 pa = PTE2PA(*pte);
+    uint64 flags = PTE_FLAGS(*pte);
+
+    if (flags & (PTE_W | PTE_WP))
+        flags = (flags & ~(PTE_W | PTE_WP)) | PTE_COW;
+    if (mappages((pagetable_t)arg, va, PGSIZE, pa, flags) < 0)
+        return -1;
+    kdup((void *)pa);
+    return 0;
+}
+
+// Make a page that is or will be writable copy-on-write.
+// Pages the decode cache protects stay protected.
+static int leaf_cow(pte_t *pte, uint64 va, void *arg)
+{
+    if (*pte & (PTE_W | PTE_WP))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+    return 0;
+}
+
+// Make the pages of VM p that are or will be writable
+// copy-on-write, in every table that maps them, shadows too,
+// so that p faults on its next store to each. p must not be
+// running.
+void vmmem_protect(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct shadow *sh;
+
+    vmmem_leaves(vs->og_pagetable, 2, 0, leaf_cow, 0);
+    if (vs->pmp_pagetable)
+        vmmem_leaves(vs->pmp_pagetable, 2, 0, leaf_cow, 0);
+    for (sh = vs->shadow; sh < &vs->shadow[NSHADOW]; sh++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (sh->root[i])
+                vmmem_leaves(sh->root[i], 2, 0, leaf_cow, 0);
+        }
+    }
+}
+
+// Empty template t. Caller holds vmtemplates.lock.
+static void template_free(struct vmtemplate *t)
+{
+    if (t->pagetable)
+    {
+        vmmem_leaves(t->pagetable, 2, 0, leaf_unmap, 0);
+        uvmfreetable(t->pagetable);
+    }
+    if (t->vs)
+        kfree((void *)t->vs);
+    memset(t, 0, sizeof(*t));
+}
+
+// Freeze VM process pid, which must not be running, as template
+// slot, replacing the template there; or, if pid is 0, just
+// empty the slot. pid's writable pages become copy-on-write.
+// Returns 0 on success, -1 on failure.
+int vmmem_snapshot(int pid, int slot)
+{
+    struct vmtemplate *t;
+    struct vm_virtual_state *vs;
+    struct proc *p;
+    int found = 0;
+
+    if (slot < 0 || slot >= NVMTEMPLATE)
+        return -1;
+    t = &vmtemplates.t[slot];
+    if (pid == 0)
+    {
+        acquire(&vmtemplates.lock);
+        template_free(t);
+        release(&vmtemplates.lock);
+        return 0;
+    }
+
+    for (p = proc; p < &proc[NPROC]; p++)
+    {
+        acquire(&p->lock);
+        if (p->pid == pid && p->state != UNUSED)
+        {
+            found = 1;
+            break;
+        }
+        release(&p->lock);
+    }
+    if (!found)
+        return -1;
+    vs = p->vm_state;
+    // a VM with several vCPUs is never frozen; see vcpu.c.
+    // nor is one restored from a checkpoint, whose pages are
+    // still in the file, or being checkpointed; see vmckpt.c.
+    if (vs == 0 || vs->group || vs->ckpt || vs->ckpt_pause ||
+        p->state == RUNNING || p->state == ZOMBIE || p->killed)
+    {
+        release(&p->lock);
+        return -1;
+    }
+
+    acquire(&vmtemplates.lock);
+    template_free(t);
+    if ((t->pagetable = uvmcreate()) == 0 ||
+        (t->vs = (struct vm_virtual_state *)kalloc()) == 0 ||
+        vmmem_leaves(vs->og_pagetable, 2, 0, leaf_share, t->pagetable) < 0)
+    {
+        template_free(t);
+        release(&vmtemplates.lock);
+        release(&p->lock);
+        return -1;
+    }
+    t->sz = p->sz;
+    t->tf = *p->trapframe;
+    memmove(t->vs, vs, sizeof(*vs));
+    t->cfg = p->vmcfg;
+    safestrcpy(t->name, p->name, sizeof(t->name));
+    t->used = 1;
+    release(&vmtemplates.lock);
+
+    // The VM's pages are shared now.
+    vmmem_protect(p);
+    release(&p->lock);
+    return 0;
+}
+
+// Make np, a new process, a VM running from template slot:
+// share the template's pages copy-on-write, and copy its
+// registers and virtual CPU state. Caller holds np->lock.
+// Returns 0 on success, -1 on failure.
+int vmmem_clone(struct proc *np, int slot)
+{
+    struct vmtemplate *t;
+
+    if (slot < 0 || slot >= NVMTEMPLATE)
+        return -1;
+    t = &vmtemplates.t[slot];
+    acquire(&vmtemplates.lock);
+    if (!t->used)
+        goto fail;
+
+    if (vmmem_leaves(t->pagetable, 2, 0, leaf_share, np->pagetable) < 0 ||
+        trap_and_emulate_vmclone(np, t->vs) < 0)
+    {
+        vmmem_leaves(np->pagetable, 2, 0, leaf_unmap, 0);
+        goto fail;
+    }
+    np->sz = t->sz;
+    *np->trapframe = t->tf;
+    np->proc_te_vm = 1;
+    // consfd is an fd of the template's process, not of np.
+    np->vmcfg = t->cfg;
+    np->vmcfg.consfd = -1;
+    safestrcpy(np->name, t->name, sizeof(np->name));
+    release(&vmtemplates.lock);
+    return 0;
+
+fail:
+    release(&vmtemplates.lock);
+    return -1;
+}
+
+// Free the pages of p's guest RAM that the guest touched, and
+// its page of patch stubs, if any (see patch.c).
+// The base page table must be back in p->pagetable, so that
+// the other tables, which only share these pages, are not
+// in use.
+void vmmem_free(struct proc *p)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    uint64 a, end;
+    pte_t *pte;
+
+    if (vs == 0)
+        return;
+    if (vs->stub && (pte = walk(vs->og_pagetable, vs->stub, 0)) != 0 && (*pte & PTE_V))
+    {
+        kfree((void *)PTE2PA(*pte));
+        *pte = 0;
+    }
+    end = VMRAMBASE + vs->memsize;
+    for (a = VMRAMBASE; a < end; a += PGSIZE)
+    {
+        if ((pte = walk(vs->og_pagetable, a, 0)) == 0)
+        {
+            // no page table page: skip the 2MB it would map.
+            a = PGROUNDDOWN(a | ((1L << PXSHIFT(1)) - 1));
+            continue;
+        }
+        if (*pte & PTE_V)
+        {
+            kfree((void *)PTE2PA(*pte));
+            *pte = 0;
+        }
+    }
+}
@@ -0,0 +1,270 @@
+// Same-page merging.
+//
+// VMs often hold pages with the same contents: zeroed RAM, the
+// same boot-time data, the same stacks. The vmmerge() system call
+// scans a few of their writable pages at a time, hashing each,
+// and maps pages that turn out to be identical to one shared
+// copy, copy-on-write, as vmclone() does, freeing the others.
+// xv6 has no kernel threads to scan in the background, so
+// vmmerge, a user daemon, makes the call every tick at a rate
+// that it is given; the scan itself runs in the kernel.
+//
+// Shared copies are kept in a hash table, each with a reference
+// of the table's own, so that later pages can be merged into it.
+// A page becomes a shared copy when another page with the same
+// hash was seen in the same pass; pages are merged into a copy
+// only once their contents compare equal. A copy that no VM maps
+// any more is dropped when the scan next comes across its slot.
+//
+// A VM's page tables may only change while it is stopped where
+// it holds no host pointers into its memory: an exit that sleeps
+// elsewhere, in a console write or reading a page from its
+// checkpoint file (see vmckpt.c), may still be using a page.
+// Only VMs asleep in wfi, in halt() once it stops polling, or in
+// HC_BALLOON (vs->idle) are scanned; idle guests are also the
+// ones whose memory is worth merging. Others are passed over
+// until the next pass, and so are VMs with several vCPUs (see
+// vcpu.c) or being checkpointed.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#include <stdbool.h>
+#include "vminfo.h"
+#include "trap-and-emulate.h"
+
+extern struct proc proc[NPROC];
+
+#define NMERGE 512      // shared copies
+#define NHINT  1024     // pages seen in this pass, by hash
+#define NREMAP 16       // pages scanned per lock hold of a VM
+
+struct
+{
+    struct spinlock lock;
+    struct
+    {
+        uint64 hash;
+        uint64 pa;      // holds a reference; 0 if unused
+    } copy[NMERGE];
+    struct
+    {
+        uint64 hash;
+        uint64 pa;
+    } hint[NHINT];
+    int slot;           // scan position: proc[] slot,
+    uint64 gpa;         // and guest-physical address in it
+    struct vmmergestat st;
+} vmmerge;
+
+// Pages of one VM that were remapped, from from[i] to to[i],
+// and made copy-on-write, in its base page table. The other
+// page tables that map them must follow.
+struct remap
+{
+    int n;
+    uint64 from[NREMAP];
+    uint64 to[NREMAP];
+};
+
+void vmmerge_init(void)
+{
+    initlock(&vmmerge.lock, "vmmerge");
+}
+
+static uint64 page_hash(uint64 *page)
+{
+    uint64 h = 0xcbf29ce484222325UL;
+
+    for (int i = 0; i < PGSIZE / sizeof(uint64); i++)
+        h = (h ^ page[i]) * 0x100000001b3UL;
+    return h;
+}
+
+// Point a PMP-restricted or shadow PTE for a remapped page at
+// its new one, copy-on-write if it was writable.
+static int leaf_remap(pte_t *pte, uint64 va, void *arg)
+{
+    struct remap *rm = (struct remap *)arg;
+    uint64 flags = PTE_FLAGS(*pte);
+
+    for (int i = 0; i < rm->n; i++)
+    {
+        if (PTE2PA(*pte) != rm->from[i])
+            continue;
+        if (flags & (PTE_W | PTE_WP))
+            flags = (flags & ~PTE_W) | PTE_COW;
+        *pte = PA2PTE(rm->to[i]) | flags;
+        break;
+    }
+    return 0;
+}
+
+// Merge the page that pte, in a VM's base page table, maps into
+// the shared copy of its contents, if there is one, or make it
+// the shared copy if a page with the same hash was seen before.
+static void merge_page(pte_t *pte, struct remap *rm)
+{
+    uint64 pa = PTE2PA(*pte);
+    uint64 h = page_hash((uint64 *)pa);
+    int c = h % NMERGE, s = h % NHINT;
+
+    vmmerge.st.scanned++;
+    // a copy that only the table holds is no longer shared.
+    if (vmmerge.copy[c].pa && krefs((void *)vmmerge.copy[c].pa) == 1)
+    {
+        kfree((void *)vmmerge.copy[c].pa);
+        vmmerge.copy[c].pa = 0;
+    }
+    if (vmmerge.copy[c].pa == pa)
+        return;
+
+    if (vmmerge.copy[c].pa && vmmerge.copy[c].hash == h &&
+        memcmp((void *)vmmerge.copy[c].pa, (void *)pa, PGSIZE) == 0)
+    {
+        kdup((void *)vmmerge.copy[c].pa);
+        *pte = PA2PTE(vmmerge.copy[c].pa) | (PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW;
+        kfree((void *)pa);
+        rm->from[rm->n] = pa;
+        rm->to[rm->n++] = vmmerge.copy[c].pa;
+        vmmerge.st.merged++;
+        return;
+    }
+
+    if (vmmerge.copy[c].pa == 0 && vmmerge.hint[s].hash == h &&
+        vmmerge.hint[s].pa != pa)
+    {
+        // seen before in this pass: share this one.
+        kdup((void *)pa);
+        vmmerge.copy[c].hash = h;
+        vmmerge.copy[c].pa = pa;
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+        rm->from[rm->n] = pa;
+        rm->to[rm->n++] = pa;
+        return;
+    }
+    vmmerge.hint[s].hash = h;
+    vmmerge.hint[s].pa = pa;
+}
+
+// Scan up to n, and at most NREMAP, of VM p's writable pages
+// from the scan position, in its image and then in its RAM, and
+// advance the position.
+// Caller holds p->lock and vmmerge.lock.
+// Returns the number of pages scanned, or -1 if p has no more.
+static int scan_proc(struct proc *p, int n)
+{
+    struct vm_virtual_state *vs = p->vm_state;
+    struct remap rm;
+    struct shadow *sh;
+    uint64 a, end = VMRAMBASE + vs->memsize;
+    pte_t *pte;
+    int scanned = 0;
+
+    rm.n = 0;
+    while (scanned < n && scanned < NREMAP)
+    {
+        a = vmmerge.gpa;
+        if (a < VMRAMBASE && a >= PGROUNDUP(p->sz))
+            a = VMRAMBASE;
+        if (a >= end)
+            break;
+        vmmerge.gpa = a + PGSIZE;
+        if ((pte = walk(vs->og_pagetable, a, 0)) == 0)
+        {
+            // no page table page: skip the 2MB it would map.
+            vmmerge.gpa = PGROUNDDOWN(a | ((1L << PXSHIFT(1)) - 1)) + PGSIZE;
+            continue;
+        }
+        if ((*pte & PTE_V) == 0 || (*pte & (PTE_W | PTE_WP | PTE_COW)) == 0)
+            continue;
+        // a page dirtied since the VM's last checkpoint stays
+        // writable, or the next would miss it; see vmckpt.c.
+        if (vs->ckpt && (*pte & PTE_COW) == 0)
+            continue;
+        merge_page(pte, &rm);
+        scanned++;
+    }
+
+    if (rm.n > 0)
+    {
+        if (vs->pmp_pagetable)
+            vmmem_leaves(vs->pmp_pagetable, 2, 0, leaf_remap, &rm);
+        for (sh = vs->shadow; sh < &vs->shadow[NSHADOW]; sh++)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                if (sh->root[i])
+                    vmmem_leaves(sh->root[i], 2, 0, leaf_remap, &rm);
+            }
+        }
+    }
+    return scanned == 0 && vmmerge.gpa >= end ? -1 : scanned;
+}
+
+// Scan up to n pages of VM memory, going on from where the last
+// call stopped, but no further than the end of a pass. Caller
+// holds vmmerge.lock.
+static void scan(int n)
+{
+    struct proc *p;
+    int got;
+
+    while (n > 0)
+    {
+        if (vmmerge.slot >= NPROC)
+        {
+            vmmerge.slot = 0;
+            vmmerge.gpa = 0;
+            vmmerge.st.passes++;
+            memset(vmmerge.hint, 0, sizeof(vmmerge.hint));
+            break;
+        }
+        p = &proc[vmmerge.slot];
+        acquire(&p->lock);
+        if ((p->state != RUNNABLE && p->state != SLEEPING) || !p->proc_te_vm ||
+            p->vm_state == 0 || !p->vm_state->idle || p->vm_state->group ||
+            p->vm_state->ckpt_pause || p->killed ||
+            (got = scan_proc(p, n)) < 0)
+        {
+            vmmerge.slot++;
+            vmmerge.gpa = 0;
+        }
+        else
+            n -= got;
+        release(&p->lock);
+    }
+}
+
+// Scan up to n pages of VM memory for pages to merge, and copy
+// the merging statistics to user address dst, if not 0.
+// Returns 0 on success, -1 if dst is bad.
+int vmmerge_scan(int n, uint64 dst)
+{
+    struct vmmergestat st;
+    int refs;
+
+    acquire(&vmmerge.lock);
+    scan(n);
+    vmmerge.st.shared = vmmerge.st.saved = 0;
+    for (int c = 0; c < NMERGE; c++)
+    {
+        // one reference is the table's.
+        if (vmmerge.copy[c].pa && (refs = krefs((void *)vmmerge.copy[c].pa) - 1) > 1)
+        {
+            vmmerge.st.shared++;
+            vmmerge.st.saved += refs - 1;
+        }
+    }
+    st = vmmerge.st;
+    release(&vmmerge.lock);
+
+    if (dst && copyout(myproc()->pagetable, dst, (char *)&st, sizeof(st)) < 0)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,53 @@
+// Run each trap-and-emulate microbenchmark guest in turn;
+// each prints its own cycles per operation. make bench-vm
+// runs this in a headless qemu.
+//
+// usage: benchvm [op...]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+char *ops[] = { "ecall", "csrr", "csrw", "sret", "mret", "trap" };
+
+void
+run(char *op)
+{
+  char guest[32];
+  char *argv[] = { guest, 0 };
+  int pid;
+
+  strcpy(guest, "vm-bench-");
+  if(strlen(op) > sizeof(guest) - 10){
+    fprintf(2, "benchvm: bad op %s\n", op);
+    return;
+  }
+  strcpy(guest + 9, op);
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "benchvm: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(guest, argv);
+    fprintf(2, "benchvm: exec %s failed\n", guest);
+    exit(1);
+  }
+  wait(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i;
+
+  if(argc > 1){
+    for(i = 1; i < argc; i++)
+      run(argv[i]);
+  } else {
+    for(i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+      run(ops[i]);
+  }
+  printf("benchvm: done\n");
+  exit(0);
+}
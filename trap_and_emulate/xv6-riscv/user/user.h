@@ -1,4 +1,8 @@
 struct stat;
+struct vminfo;
+struct vmtrace;
+struct vmstat;
+struct vmmergestat;
 
 // system calls
 int fork(void);
@@ -22,6 +26,15 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int vminfo(int, struct vminfo*);
+int vmctl(int, int, uint64);
+int vmtrace(int, struct vmtrace*, int);
+int vmsnapshot(int, int);
+int vmclone(int);
+int vmstat(int, struct vmstat*);
+int vmmerge(int, struct vmmergestat*);
+int vmcheckpoint(int, int);
+int vmrestore(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -36,3 +36,12 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("vminfo");
+entry("vmctl");
+entry("vmtrace");
+entry("vmsnapshot");
+entry("vmclone");
+entry("vmstat");
+entry("vmmerge");
+entry("vmcheckpoint");
+entry("vmrestore");
@@ -0,0 +1,50 @@
+// Reclaim memory from a VM through its balloon: ask VM pid to
+// give back pages pages of its RAM, wait for it to, and report
+// how much host memory that freed. Asking for 0 pages gives
+// them all back to the VM. Without pages, just reports.
+//
+// usage: vmballoon pid [pages]
+//
+// The guest must run a balloon driver, as vm-balloon does.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/vminfo.h"
+#include "user/user.h"
+
+#define WAIT_TICKS 20  // how long to wait for the guest
+
+int
+main(int argc, char *argv[])
+{
+  struct vminfo vi;
+  int pid, pages = -1;
+
+  if(argc < 2 || argc > 3){
+    fprintf(2, "usage: vmballoon pid [pages]\n");
+    exit(1);
+  }
+  pid = atoi(argv[1]);
+  if(argc > 2){
+    pages = atoi(argv[2]);
+    if(vmctl(pid, VMCTL_BALLOON, pages) < 0){
+      fprintf(2, "vmballoon: cannot set the balloon of %d to %d pages\n", pid, pages);
+      exit(1);
+    }
+    for(int i = 0; i < WAIT_TICKS; i++){
+      if(vminfo(pid, &vi) < 0 || vi.balloon == pages)
+        break;
+      sleep(1);
+    }
+  }
+
+  if(vminfo(pid, &vi) < 0){
+    fprintf(2, "vmballoon: %d is not a VM\n", pid);
+    exit(1);
+  }
+  printf("vmballoon: %d: %l pages in the balloon", pid, vi.balloon);
+  if(pages >= 0 && vi.balloon != pages)
+    printf(" of %d asked for", pages);
+  printf(", %l host pages freed in all\n", vi.ballooned);
+  exit(0);
+}
@@ -0,0 +1,66 @@
+// Checkpoint a running VM to a file, or restore one from it.
+// Checkpointing it to the same file again writes only the
+// pages that it changed since. A restored VM runs as a child
+// of vmckpt, which waits for it; its pages are read from the
+// file as it touches them.
+//
+// usage: vmckpt pid file
+//        vmckpt -r file
+//
+// Only a small VM fits in a checkpoint file. For example, with
+// vm-hello started in the background by 'vmrun -k 128 vm-hello &':
+//   $ vmckpt 5 hello.ckpt
+//   $ vmckpt -r hello.ckpt
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/vminfo.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct vminfo vi;
+  int fd, pid, n, t0;
+
+  if(argc != 3){
+    fprintf(2, "usage: vmckpt pid file\n       vmckpt -r file\n");
+    exit(1);
+  }
+
+  if(strcmp(argv[1], "-r") == 0){
+    if((fd = open(argv[2], O_RDONLY)) < 0){
+      fprintf(2, "vmckpt: cannot open %s\n", argv[2]);
+      exit(1);
+    }
+    t0 = uptime();
+    pid = vmrestore(fd);
+    close(fd);
+    if(pid < 0){
+      fprintf(2, "vmckpt: %s is not a checkpoint\n", argv[2]);
+      exit(1);
+    }
+    printf("vmckpt: restored %s as %d in %d ticks\n", argv[2], pid, uptime() - t0);
+    wait(0);
+    exit(0);
+  }
+
+  pid = atoi(argv[1]);
+  if((fd = open(argv[2], O_CREATE | O_RDWR)) < 0){
+    fprintf(2, "vmckpt: cannot open %s\n", argv[2]);
+    exit(1);
+  }
+  t0 = uptime();
+  n = vmcheckpoint(pid, fd);
+  close(fd);
+  if(n < 0){
+    fprintf(2, "vmckpt: cannot checkpoint %d to %s\n", pid, argv[2]);
+    exit(1);
+  }
+  printf("vmckpt: %d pages of %d written to %s in %d ticks", n, pid, argv[2], uptime() - t0);
+  if(vminfo(pid, &vi) == 0 && vi.ckptloads > 0)
+    printf("; %l read from its checkpoint so far", vi.ckptloads);
+  printf("\n");
+  exit(0);
+}
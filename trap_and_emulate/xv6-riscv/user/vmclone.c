@@ -0,0 +1,81 @@
+// Boot a guest once, then start copies of it from a snapshot
+// instead of booting each: the copies share the guest's memory
+// copy-on-write, so starting one costs a page table, not a boot.
+//
+// usage: vmclone [-w ticks] [-n count] guest [args...]
+//
+// The guest runs for ticks clock ticks before it is frozen
+// as a template; the original is then killed, and count
+// clones run in its place.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/vminfo.h"
+#include "user/user.h"
+
+#define SLOT 0
+
+void
+usage(void)
+{
+  fprintf(2, "usage: vmclone [-w ticks] [-n count] guest [args...]\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, pid, n = 4, ticks = 10, t0, t1;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++){
+    if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+      ticks = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      n = atoi(argv[++i]);
+    else
+      usage();
+  }
+  if(i >= argc || n <= 0)
+    usage();
+
+  t0 = uptime();
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "vmclone: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[i], argv + i);
+    fprintf(2, "vmclone: exec %s failed\n", argv[i]);
+    exit(1);
+  }
+  sleep(ticks);
+
+  // the guest may be running on another CPU just now.
+  while(vmsnapshot(pid, SLOT) < 0){
+    if(uptime() - t0 > ticks + 100){
+      fprintf(2, "vmclone: cannot snapshot %s\n", argv[i]);
+      kill(pid);
+      wait(0);
+      exit(1);
+    }
+    sleep(1);
+  }
+  printf("vmclone: booted and froze %s in %d ticks\n", argv[i], uptime() - t0);
+  kill(pid);
+  wait(0);
+
+  t1 = uptime();
+  for(i = 0; i < n; i++){
+    if(vmclone(SLOT) < 0){
+      fprintf(2, "vmclone: clone %d failed\n", i);
+      break;
+    }
+  }
+  printf("vmclone: started %d clones in %d ticks\n", i, uptime() - t1);
+  vmsnapshot(0, SLOT);
+
+  while(wait(0) >= 0)
+    ;
+  exit(0);
+}
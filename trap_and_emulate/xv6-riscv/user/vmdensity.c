@@ -0,0 +1,93 @@
+// VM density benchmark.
+// Boots N copies of a guest at once, for N = 1, 2, 4, ... up to
+// a maximum, and reports the aggregate rate of privileged
+// instructions emulated by the hypervisor. Run it under
+// different CPUS= settings to see how emulation scales with harts.
+//
+// usage: vmdensity [maxvms [guest [exitbudget]]]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/vminfo.h"
+#include "user/user.h"
+
+#define TICKS_PER_SEC 10  // timer interrupt is about 1/10th second in qemu
+#define CYCLES_PER_TICK 1000000  // timebase cycles per timer interrupt
+
+void
+run(int n, char *guest)
+{
+  struct vminfo before, after;
+  char *argv[] = { guest, 0 };
+  int i, pid, started, t0, t1;
+  uint64 emulated, exits;
+
+  vminfo(0, &before);
+  t0 = uptime();
+  for(started = 0; started < n; started++){
+    pid = fork();
+    if(pid < 0){
+      printf("vmdensity: fork failed after %d guests\n", started);
+      break;
+    }
+    if(pid == 0){
+      exec(guest, argv);
+      printf("vmdensity: exec %s failed\n", guest);
+      exit(1);
+    }
+  }
+  for(i = 0; i < started; i++)
+    wait(0);
+  t1 = uptime();
+  vminfo(0, &after);
+
+  emulated = after.emulated - before.emulated;
+  exits = after.exits - before.exits;
+  if(t1 == t0)
+    t1 = t0 + 1;
+  printf("vmdensity: %d guests: %l exits, %l emulated in %d ticks, %l exits/s, %l emulated/s\n",
+         started, exits, emulated, t1 - t0,
+         exits * TICKS_PER_SEC / (t1 - t0),
+         emulated * TICKS_PER_SEC / (t1 - t0));
+  printf("vmdensity: decode cache %l hits, %l misses\n",
+         after.dcache_hits - before.dcache_hits,
+         after.dcache_misses - before.dcache_misses);
+  printf("vmdensity: %l exits saved by batching, %l cycles per emulated instruction\n",
+         after.batched - before.batched,
+         emulated ? (after.cycles - before.cycles) / emulated : 0);
+  printf("vmdensity: %l wfi, %l woken while polling, halted %d%% of the time\n",
+         after.wfi - before.wfi, after.polled - before.polled,
+         started ? (int)((after.halted - before.halted) * 100 /
+                         ((uint64)(t1 - t0) * CYCLES_PER_TICK * started)) : 0);
+  printf("vmdensity: %l csr reads patched out of guest text\n",
+         after.patched - before.patched);
+  printf("vmdensity: %l image pages shared rather than loaded\n",
+         after.imageshared - before.imageshared);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, maxvms = 16;
+  char *guest = "vm-test";
+
+  if(argc > 1)
+    maxvms = atoi(argv[1]);
+  if(argc > 2)
+    guest = argv[2];
+  if(maxvms < 1){
+    fprintf(2, "usage: vmdensity [maxvms [guest [exitbudget]]]\n");
+    exit(1);
+  }
+  // the guests inherit our VM settings
+  if(argc > 3 && vmctl(0, VMCTL_EXITBUDGET, atoi(argv[3])) < 0){
+    fprintf(2, "vmdensity: bad exit budget %s\n", argv[3]);
+    exit(1);
+  }
+
+  for(n = 1; n <= maxvms; n *= 2)
+    run(n, guest);
+  if(n / 2 != maxvms)
+    run(maxvms, guest);
+  exit(0);
+}
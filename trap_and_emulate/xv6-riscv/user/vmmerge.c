@@ -0,0 +1,62 @@
+// Same-page merging daemon: scans VM memory for identical
+// pages to share, a few pages every clock tick, through the
+// vmmerge() system call. Only guests halted in wfi or waiting
+// for balloon requests are merged. With -s, just prints how
+// much merging has saved so far.
+//
+// usage: vmmerge [-s] [pages per tick]
+//
+// Start it in the background, before or after the VMs:
+//   $ vmmerge 64 &
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/vminfo.h"
+#include "user/user.h"
+
+#define REPORT_TICKS 100  // ticks between reports, about 10s in qemu
+
+void
+report(struct vmmergestat *st)
+{
+  printf("vmmerge: %l pages scanned in %l passes, %l merged; "
+         "%l shared copies save %l pages\n",
+         st->scanned, st->passes, st->merged, st->shared, st->saved);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct vmmergestat st;
+  int i, rate = 64, stats = 0;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++){
+    if(strcmp(argv[i], "-s") == 0)
+      stats = 1;
+    else
+      goto usage;
+  }
+  if(i < argc)
+    rate = atoi(argv[i++]);
+  if(i < argc || rate < 1)
+    goto usage;
+
+  if(stats){
+    if(vmmerge(0, &st) < 0)
+      exit(1);
+    report(&st);
+    exit(0);
+  }
+
+  for(i = 1; ; i++){
+    if(vmmerge(rate, &st) < 0)
+      exit(1);
+    if(i % REPORT_TICKS == 0)
+      report(&st);
+    sleep(1);
+  }
+
+usage:
+  fprintf(2, "usage: vmmerge [-s] [pages per tick]\n");
+  exit(1);
+}
@@ -0,0 +1,64 @@
+// Run a guest with a given amount of RAM, in megabytes, or
+// with -k in kilobytes, as for a guest small enough to be
+// checkpointed (see vmckpt). The guest's RAM is allocated as it
+// touches it, so a large size costs nothing up front. With -l, the guest's console
+// output through hypercalls goes to a log file instead of
+// the console. With -n, the hypervisor leaves the guest's
+// text alone, and every read of a constant CSR exits. With -c,
+// the guest gets ncpu vCPUs, which the host runs in parallel.
+//
+// usage: vmrun [-m megabytes | -k kilobytes] [-l logfile] [-n] [-c ncpu] guest [args...]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/vminfo.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+void
+usage(void)
+{
+  fprintf(2, "usage: vmrun [-m megabytes | -k kilobytes] [-l logfile] [-n] [-c ncpu] guest [args...]\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, kb, fd;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++){
+    if((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "-k") == 0) && i + 1 < argc){
+      kb = atoi(argv[i + 1]) * (argv[i][1] == 'm' ? 1024 : 1);
+      i++;
+      // the guest keeps our VM settings across exec.
+      if(kb <= 0 || vmctl(0, VMCTL_MEMSIZE, (uint64)kb * 1024) < 0){
+        fprintf(2, "vmrun: bad RAM size %s\n", argv[i]);
+        exit(1);
+      }
+    } else if(strcmp(argv[i], "-l") == 0 && i + 1 < argc){
+      fd = open(argv[++i], O_CREATE | O_WRONLY | O_TRUNC);
+      if(fd < 0 || vmctl(0, VMCTL_CONSFD, fd) < 0){
+        fprintf(2, "vmrun: cannot log to %s\n", argv[i]);
+        exit(1);
+      }
+    } else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+      if(vmctl(0, VMCTL_NCPU, atoi(argv[++i])) < 0){
+        fprintf(2, "vmrun: bad vCPU count %s\n", argv[i]);
+        exit(1);
+      }
+    } else if(strcmp(argv[i], "-n") == 0){
+      if(vmctl(0, VMCTL_PATCH, 0) < 0){
+        fprintf(2, "vmrun: cannot turn patching off\n");
+        exit(1);
+      }
+    } else
+      usage();
+  }
+  if(i >= argc)
+    usage();
+
+  exec(argv[i], argv + i);
+  fprintf(2, "vmrun: exec %s failed\n", argv[i]);
+  exit(1);
+}
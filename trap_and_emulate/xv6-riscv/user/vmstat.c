@@ -0,0 +1,152 @@
+// Where a VM's time goes: its exits by cause, the privileged
+// instructions it had emulated by class and by CSR, and how
+// long exits of each kind took, as percentiles.
+//
+// usage: vmstat [-i ticks] [pid]
+//
+// With -i, reports what happened over the next ticks clock
+// ticks, else over the VM's whole life. pid 0, the default,
+// is all VMs, including those that have exited.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/vminfo.h"
+#include "user/user.h"
+
+#define CYCLES_PER_TICK 1000000  // timebase cycles per timer interrupt
+#define CYCLES_PER_SEC  10000000 // timebase frequency in qemu
+
+struct vmstat before, after;
+
+char *insnname[VMSTAT_NINSN] = {
+[VMI_ECALL]  "ecall",
+[VMI_SRET]   "sret",
+[VMI_MRET]   "mret",
+[VMI_CSRR]   "csr read",
+[VMI_CSRW]   "csr write",
+[VMI_WFI]    "wfi",
+[VMI_SFENCE] "sfence.vma",
+[VMI_OTHER]  "illegal",
+};
+
+char *kindname[VMSTAT_NKIND] = {
+[VMX_INSN]  "emulation",
+[VMX_WFI]   "wfi",
+[VMX_FAULT] "page fault",
+[VMX_INTR]  "interrupt",
+};
+
+uint64 cycles;  // timebase cycles that the counts cover
+
+// n events per second.
+uint64
+rate(uint64 n)
+{
+  return cycles ? n * CYCLES_PER_SEC / cycles : 0;
+}
+
+// The count for csr in s.
+uint64
+csrcount(struct vmstat *s, uint csr)
+{
+  for(int i = 0; i < VMSTAT_NCSR && s->csr[i].n; i++)
+    if(s->csr[i].csr == csr)
+      return s->csr[i].n;
+  return 0;
+}
+
+// The bucket in hist, of n counts in all, that holds the
+// pct'th percentile.
+int
+percentile(uint64 *hist, uint64 n, int pct)
+{
+  uint64 sum = 0;
+  int b;
+
+  for(b = 0; b < VMSTAT_NHIST - 1; b++){
+    sum += hist[b];
+    if(sum * 100 >= n * pct)
+      break;
+  }
+  return b;
+}
+
+void
+usage(void)
+{
+  fprintf(2, "usage: vmstat [-i ticks] [pid]\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, k, pid = 0, ticks = 0;
+  uint64 n, d, hist[VMSTAT_NHIST];
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++){
+    if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+      ticks = atoi(argv[++i]);
+    else
+      usage();
+  }
+  if(i < argc)
+    pid = atoi(argv[i++]);
+  if(i < argc || ticks < 0)
+    usage();
+
+  // before stays zero without -i.
+  if(ticks > 0){
+    if(vmstat(pid, &before) < 0){
+      fprintf(2, "vmstat: %d is not a VM\n", pid);
+      exit(1);
+    }
+    sleep(ticks);
+  }
+  if(vmstat(pid, &after) < 0){
+    fprintf(2, "vmstat: %d is not a VM\n", pid);
+    exit(1);
+  }
+  cycles = ticks > 0 ? (uint64)ticks * CYCLES_PER_TICK : after.time;
+
+  n = after.exits - before.exits;
+  printf("%l exits, %l/s\n", n, rate(n));
+
+  printf("by cause:\n");
+  for(i = 0; i < VMSTAT_NCAUSE; i++){
+    if((d = after.cause[i] - before.cause[i]) == 0)
+      continue;
+    printf("  %s %d: %l, %l/s\n", i < 16 ? "exception" : "interrupt", i % 16, d, rate(d));
+  }
+
+  printf("emulated instructions:\n");
+  for(i = 0; i < VMSTAT_NINSN; i++){
+    if((d = after.insn[i] - before.insn[i]) == 0)
+      continue;
+    printf("  %s: %l, %l/s\n", insnname[i], d, rate(d));
+  }
+
+  printf("csr instructions:\n");
+  for(i = 0; i < VMSTAT_NCSR && after.csr[i].n; i++){
+    if((d = after.csr[i].n - csrcount(&before, after.csr[i].csr)) == 0)
+      continue;
+    printf("  csr %x: %l, %l/s\n", after.csr[i].csr, d, rate(d));
+  }
+
+  printf("exit latency, timebase cycles:\n");
+  for(k = 0; k < VMSTAT_NKIND; k++){
+    n = 0;
+    for(i = 0; i < VMSTAT_NHIST; i++){
+      hist[i] = after.hist[k][i] - before.hist[k][i];
+      n += hist[i];
+    }
+    if(n == 0)
+      continue;
+    // bucket b holds exits of under 2^(b+1) cycles.
+    printf("  %s: %l exits, p50 < %l, p90 < %l, p99 < %l\n", kindname[k], n,
+           1UL << (percentile(hist, n, 50) + 1),
+           1UL << (percentile(hist, n, 90) + 1),
+           1UL << (percentile(hist, n, 99) + 1));
+  }
+  exit(0);
+}
@@ -0,0 +1,105 @@
+// Print the emulation trace of a VM.
+// Either starts a guest with tracing turned on, or attaches
+// to a running VM, and prints each emulated instruction until
+// the VM exits. -m traces only privilege mode changes, and -v
+// adds the timebase cycle and mode change to each line.
+//
+// usage: vmtrace [-m] [-v] guest [args...]
+//        vmtrace [-m] [-v] -p pid
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/vminfo.h"
+#include "user/user.h"
+
+#define NREC 64
+#define STARTWAIT 50  // ticks to wait for a new guest to become a VM
+
+struct vmtrace rec[NREC];
+
+void
+print(struct vmtrace *t, int verbose)
+{
+  uint32 insn = t->insn;
+
+  if(verbose)
+    printf("%l %d->%d ", t->cycle, t->from, t->to);
+  if(insn == 0x73)
+    printf("(EC at %p)\n", t->pc);
+  else
+    printf("(PI at %p) op = %x, rd = %x, funct3 = %x, rs1 = %x, uimm = %x\n",
+           t->pc, insn & 0x7F, (insn >> 7) & 0x1F, (insn >> 12) & 0x7,
+           (insn >> 15) & 0x1F, (insn >> 20) & 0xFFF);
+}
+
+// print the trace of pid until it exits.
+void
+drain(int pid, int verbose)
+{
+  int i, n, seen = 0, waited = 0;
+
+  for(;;){
+    n = vmtrace(pid, rec, NREC);
+    if(n < 0){
+      // a guest we just forked may not have exec'd yet.
+      if(seen || waited++ >= STARTWAIT)
+        break;
+      sleep(1);
+      continue;
+    }
+    seen = 1;
+    if(n == 0)
+      sleep(1);
+    for(i = 0; i < n; i++)
+      print(&rec[i], verbose);
+  }
+}
+
+void
+usage(void)
+{
+  fprintf(2, "usage: vmtrace [-m] [-v] guest [args...]\n");
+  fprintf(2, "       vmtrace [-m] [-v] -p pid\n");
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, pid, verbose = 0, level = VMTRACE_ALL;
+
+  for(i = 1; i < argc && argv[i][0] == '-'; i++){
+    if(strcmp(argv[i], "-m") == 0)
+      level = VMTRACE_MODE;
+    else if(strcmp(argv[i], "-v") == 0)
+      verbose = 1;
+    else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc){
+      pid = atoi(argv[i + 1]);
+      if(vmctl(pid, VMCTL_TRACE, level) < 0){
+        fprintf(2, "vmtrace: no process %d\n", pid);
+        exit(1);
+      }
+      drain(pid, verbose);
+      exit(0);
+    } else
+      usage();
+  }
+  if(i >= argc)
+    usage();
+
+  // the guest inherits our VM settings.
+  vmctl(0, VMCTL_TRACE, level);
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "vmtrace: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[i], argv + i);
+    fprintf(2, "vmtrace: exec %s failed\n", argv[i]);
+    exit(1);
+  }
+  drain(pid, verbose);
+  wait(0);
+  exit(0);
+}
@@ -0,0 +1,62 @@
+// Balloon guest.
+// Boots like vm-test, touches the upper half of its RAM as a
+// working set, and then goes idle, running only its balloon
+// driver: it waits in HC_BALLOON for the host to ask for pages,
+// gives back pages from the top of the working set, and takes
+// them back when the host lowers its target.
+// Run from the host shell with: vm-balloon &
+// and then: vmballoon pid pages
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#include <stdbool.h>
+
+#define WAIT 100  // host ticks to wait for a new target, about 10s
+
+// Print a message and x in hex; the guest has no printf.
+static void printhex(char *s, uint64 x) {
+    static const char digits[] = "0123456789abcdef";
+    char buf[19];
+
+    buf[0] = '0';
+    buf[1] = 'x';
+    for (int i = 0; i < 16; i++)
+        buf[2 + i] = digits[(x >> (60 - 4 * i)) & 0xF];
+    buf[18] = '\n';
+    hc_print(s);
+    hc_puts(buf, sizeof(buf));
+}
+
+void kernel_entry(void) {
+    uint64 base, size, pool, npool, inflated = 0, n;
+    long d;
+
+    size = hc_meminfo(&base);
+    pool = base + size / 2;
+    npool = size / 2 / PGSIZE;
+    for (uint64 i = 0; i < npool; i++)
+        *(volatile char *)(pool + i * PGSIZE) = 1;
+    printhex("vm-balloon: pages in use ", npool);
+
+    // the balloon holds the top inflated pages of the pool.
+    for (;;) {
+        d = hc_balloon(WAIT);
+        if (d > 0 && inflated < npool) {
+            n = d < npool - inflated ? d : npool - inflated;
+            if (hc_inflate(pool + (npool - inflated - n) * PGSIZE, n) < 0)
+                panic("balloon inflate");
+            inflated += n;
+            printhex("vm-balloon: pages given back ", inflated);
+        } else if (d < 0 && inflated > 0) {
+            n = -d < inflated ? -d : inflated;
+            if (hc_deflate(pool + (npool - inflated) * PGSIZE, n) < 0)
+                panic("balloon deflate");
+            inflated -= n;
+            printhex("vm-balloon: pages given back ", inflated);
+        }
+    }
+}
@@ -0,0 +1,146 @@
+// Trap-and-emulate microbenchmark guests.
+// Built once per operation, as vm-bench-<op>, with BENCH the
+// name of the operation. Each times NITER iterations of a
+// tight loop of that operation with rdtime, which the host
+// lets it read without an exit, and prints timebase cycles
+// per iteration on the host console through a hypercall:
+//
+//   ecall   S-mode ecall to an M-mode handler that skips it
+//   csrr    S-mode read of sscratch
+//   csrw    S-mode write of sscratch
+//   sret    S-mode sret to S-mode, with the csrs that sets SPP
+//   mret    M-mode mret to M-mode, with the csrs that sets MPP
+//   trap    U-mode ecall to an S-mode handler that saves a0,
+//           reads scause and sepc, advances sepc and returns
+//
+// Run them all from the host shell with benchvm, or from the
+// build host with make bench-vm. Like vm-idle, these have
+// their own start() and need no ramdisk.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#include <stdbool.h>
+
+#define NITER 100000
+
+#ifndef BENCH
+#define BENCH "ecall"
+#endif
+
+// entry.S needs one stack per CPU.
+__attribute__ ((aligned (16))) char stack0[STSIZE * NCPU];
+
+// benchvec.S
+void mvec(void);
+void svec(void);
+
+void smain(void);
+
+uint64 elapsed;  // timebase cycles for NITER iterations
+
+static bool is(const char *op) {
+    return strncmp(BENCH, op, 8) == 0;
+}
+
+// Print x in decimal; the guest has no printf.
+static void printnum(uint64 x) {
+    char buf[20];
+    int i = sizeof(buf);
+
+    do {
+        buf[--i] = '0' + x % 10;
+        x /= 10;
+    } while (x);
+    hc_puts(buf + i, sizeof(buf) - i);
+}
+
+// entry.S jumps here in machine mode on stack0.
+void start(void) {
+    uint64 n = NITER + 1, t0;
+
+    w_mtvec((uint64) mvec);
+    w_medeleg(1 << 8);  // ecalls from U-mode go to S-mode
+
+    if (is("mret")) {
+        t0 = r_time();
+        asm volatile(
+            "la t0, 1f\n"
+            "csrw mepc, t0\n"
+            "1: addi %0, %0, -1\n"
+            "beqz %0, 2f\n"
+            "csrs mstatus, %1\n"
+            "mret\n"
+            "2:\n"
+            : "+r" (n) : "r" (MSTATUS_MPP_M) : "t0", "memory");
+        elapsed = r_time() - t0;
+    }
+
+    // on to smain() in S-mode.
+    w_mstatus((r_mstatus() & ~MSTATUS_MPP_MASK) | MSTATUS_MPP_S);
+    w_mepc((uint64) smain);
+    asm volatile("mret");
+}
+
+// U-mode: the trap loop. svec() ends it in udone().
+static void ubench(void) {
+    register uint64 a7 asm("a7") = 0;
+    uint64 t0 = r_time();
+
+    for (int i = 0; i < NITER; i++)
+        asm volatile("ecall" : : "r" (a7) : "a0", "t0", "t1", "memory");
+    elapsed = r_time() - t0;
+    a7 = 1;
+    asm volatile("ecall" : : "r" (a7));
+}
+
+// S-mode, back from the U-mode loop.
+void udone(void) {
+    hc_print("vm-bench-" BENCH ": ");
+    printnum(elapsed / NITER);
+    hc_print(" cycles per iteration\n");
+
+    /* Illegal in every mode, so the hypervisor ends the VM. */
+    asm volatile("ebreak");
+    while (true);
+}
+
+void smain(void) {
+    register uint64 a7 asm("a7") = 0;  // not a hypercall
+    uint64 n = NITER + 1, t0, x = 0;
+
+    w_stvec((uint64) svec);
+    t0 = r_time();
+    if (is("ecall")) {
+        for (int i = 0; i < NITER; i++)
+            asm volatile("ecall" : : "r" (a7) : "t0", "memory");
+    } else if (is("csrr")) {
+        for (int i = 0; i < NITER; i++)
+            x += r_sscratch();
+    } else if (is("csrw")) {
+        for (int i = 0; i < NITER; i++)
+            w_sscratch(i);
+    } else if (is("sret")) {
+        asm volatile(
+            "la t0, 1f\n"
+            "csrw sepc, t0\n"
+            "1: addi %0, %0, -1\n"
+            "beqz %0, 2f\n"
+            "csrs sstatus, %1\n"
+            "sret\n"
+            "2:\n"
+            : "+r" (n) : "r" (SSTATUS_SPP) : "t0", "memory");
+    } else if (is("trap")) {
+        // to ubench() in U-mode; it comes back in udone().
+        w_sstatus(r_sstatus() & ~SSTATUS_SPP);
+        w_sepc((uint64) ubench);
+        asm volatile("sret");
+    }
+    if (!is("mret"))
+        elapsed = r_time() - t0;
+    w_sscratch(x);
+    udone();
+}
@@ -0,0 +1,27 @@
+// CSR access microbenchmark guest.
+// Boots like vm-test, then hammers a supervisor CSR from
+// S-mode so that nearly every exit is an emulated csrr/csrw.
+// Run from the host shell with: vmdensity 1 vm-csrbench
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#include <stdbool.h>
+
+#define NITER 1000000  // csrw+csrr pairs, so 2*NITER exits
+
+void kernel_entry(void) {
+    uint64 x = 0;
+
+    for (int i = 0; i < NITER; i++) {
+        w_sscratch(x + 1);
+        x = r_sscratch();
+    }
+
+    /* Illegal in every mode, so the hypervisor ends the VM. */
+    asm volatile("ebreak");
+    while (true);
+}
@@ -33,6 +33,21 @@ void            panic(char *s);
 // elf.c
 uint64          read_kernel_elf(void);
 
+// hypercall.c
+int             hc_probe(void);
+int             hc_puts(const char*, int);
+int             hc_print(const char*);
+uint64          hc_time(void);
+void            hc_yield(void);
+void            hc_settimer(uint64);
+uint64          hc_meminfo(uint64*);
+int             hc_consinit(void);
+void            hc_conswrite(const char*, int);
+void            hc_consflush(void);
+long            hc_balloon(uint64);
+long            hc_inflate(uint64, uint64);
+long            hc_deflate(uint64, uint64);
+
 // kernel.c
 void            kernel_entry(void);
 
@@ -0,0 +1,87 @@
+// Hypercall demo guest.
+// Boots like vm-test, then uses each hypercall once from
+// S-mode and prints what it got on the host console, then
+// logs NLOG lines through the console ring with few kicks,
+// and NLOG more through the virtual UART, polling it the way
+// xv6's uartputc_sync() does.
+// Run from the host shell with: vm-hello, or to log to a
+// file: vmrun -l log vm-hello
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#include <stdbool.h>
+
+#define NYIELD 10
+#define NLOG   100
+
+#define Reg(reg) ((volatile unsigned char *)(UART0 + reg))
+#define THR 0                 // transmit holding register
+#define LSR 5                 // line status register
+#define LSR_TX_IDLE (1<<5)    // THR can accept another character
+
+static void uart_puts(char *s) {
+    for (; *s; s++) {
+        while ((*Reg(LSR) & LSR_TX_IDLE) == 0)
+            ;
+        *Reg(THR) = *s;
+    }
+}
+
+// Print x in hex; the guest has no printf.
+static void printhex(uint64 x) {
+    static const char digits[] = "0123456789abcdef";
+    char buf[19];
+
+    buf[0] = '0';
+    buf[1] = 'x';
+    for (int i = 0; i < 16; i++)
+        buf[2 + i] = digits[(x >> (60 - 4 * i)) & 0xF];
+    buf[18] = '\n';
+    hc_puts(buf, sizeof(buf));
+}
+
+void kernel_entry(void) {
+    uint64 t0, base, size;
+
+    hc_print("vm-hello: hypercall version ");
+    printhex(hc_probe());
+
+    size = hc_meminfo(&base);
+    hc_print("vm-hello: RAM at ");
+    printhex(base);
+    hc_print("vm-hello: RAM bytes ");
+    printhex(size);
+
+    t0 = hc_time();
+    for (int i = 0; i < NYIELD; i++)
+        hc_yield();
+    hc_print("vm-hello: cycles per yield ");
+    printhex((hc_time() - t0) / NYIELD);
+
+    hc_settimer(-1);
+
+    if (hc_consinit() < 0)
+        panic("no console ring");
+    t0 = hc_time();
+    for (int i = 0; i < NLOG; i++)
+        hc_conswrite("vm-hello: a line through the console ring\n", 42);
+    hc_consflush();
+    hc_print("vm-hello: cycles per ring line ");
+    printhex((hc_time() - t0) / NLOG);
+
+    t0 = hc_time();
+    for (int i = 0; i < NLOG; i++)
+        uart_puts("vm-hello: a line through the UART\n");
+    hc_print("vm-hello: cycles per UART line ");
+    printhex((hc_time() - t0) / NLOG);
+
+    hc_print("vm-hello: done\n");
+
+    /* Illegal in every mode, so the hypervisor ends the VM. */
+    asm volatile("ebreak");
+    while (true);
+}
@@ -0,0 +1,108 @@
+// Guest side of the hypercall ABI; see kernel/hypercall.h.
+// Only usable from S-mode. Buffers are passed by address as
+// the guest kernel sees them, so its paging must be off or
+// map them one-to-one.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+#include "kernel/hypercall.h"
+
+static uint64 hypercall(uint64 fn, uint64 arg0, uint64 arg1, uint64 *ret1) {
+    register uint64 a0 asm("a0") = arg0;
+    register uint64 a1 asm("a1") = arg1;
+    register uint64 a6 asm("a6") = fn;
+    register uint64 a7 asm("a7") = HC_MAGIC;
+
+    asm volatile("ecall" : "+r" (a0), "+r" (a1) : "r" (a6), "r" (a7) : "memory");
+    if (ret1)
+        *ret1 = a1;
+    return a0;
+}
+
+// The version of the hypercall ABI.
+int hc_probe(void) {
+    return hypercall(HC_PROBE, 0, 0, 0);
+}
+
+// Write n bytes of s to the host console; returns the number
+// written, or -1.
+int hc_puts(const char *s, int n) {
+    int done = 0, r;
+
+    while (done < n) {
+        r = hypercall(HC_PUTS, (uint64) s + done, n - done, 0);
+        if (r <= 0)
+            return done ? done : -1;
+        done += r;
+    }
+    return done;
+}
+
+int hc_print(const char *s) {
+    return hc_puts(s, strlen(s));
+}
+
+// The CLINT's mtime, which S-mode cannot read without an exit.
+uint64 hc_time(void) {
+    return hypercall(HC_TIME, 0, 0, 0);
+}
+
+// Give up the host CPU to other VMs and processes.
+void hc_yield(void) {
+    hypercall(HC_YIELD, 0, 0, 0);
+}
+
+// Set the CLINT's mtimecmp for the guest's hart.
+void hc_settimer(uint64 deadline) {
+    hypercall(HC_SETTIMER, deadline, 0, 0);
+}
+
+// The size of guest RAM in bytes, and its base in *base.
+uint64 hc_meminfo(uint64 *base) {
+    return hypercall(HC_MEMINFO, 0, 0, base);
+}
+
+// Console ring, shared with the hypervisor.
+static struct hcons cons __attribute__ ((aligned (PGSIZE)));
+
+// Set up the console ring. Returns 0, or -1 on failure.
+int hc_consinit(void) {
+    return hypercall(HC_CONSRING, (uint64) &cons, 0, 0);
+}
+
+// Put n bytes of s in the console ring, kicking the hypervisor
+// only if it fills up.
+void hc_conswrite(const char *s, int n) {
+    for (int i = 0; i < n; i++) {
+        if ((cons.prod + 1) % HCONS_SIZE == cons.cons)
+            hc_consflush();
+        cons.data[cons.prod] = s[i];
+        cons.prod = (cons.prod + 1) % HCONS_SIZE;
+    }
+}
+
+// Have the hypervisor write out the console ring.
+void hc_consflush(void) {
+    hypercall(HC_CONSKICK, 0, 0, 0);
+}
+
+// Wait up to ticks host clock ticks for the host to change the
+// balloon's target; returns the pages to give back, or, if
+// negative, that may be taken back.
+long hc_balloon(uint64 ticks) {
+    return hypercall(HC_BALLOON, ticks, 0, 0);
+}
+
+// Give the host back npages pages of RAM from base, which the
+// guest will not touch until it takes them back.
+long hc_inflate(uint64 base, uint64 npages) {
+    return hypercall(HC_INFLATE, base, npages, 0);
+}
+
+// Take back npages pages of RAM from base; they read as zeroes.
+long hc_deflate(uint64 base, uint64 npages) {
+    return hypercall(HC_DEFLATE, base, npages, 0);
+}
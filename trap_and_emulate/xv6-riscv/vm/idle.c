@@ -0,0 +1,40 @@
+// Idle guest, for wfi emulation.
+// Stays in M-mode and waits in wfi NTICKS times, with the
+// virtual timer set INTERVAL cycles ahead each time, so that
+// it is idle for nearly all of its run. mstatus.MIE stays
+// clear, so the timer ends each wfi without a trap.
+// Run from the host shell with: vmdensity 4 vm-idle
+//
+// Unlike the other guests, it has its own start() and needs
+// no ramdisk.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#include <stdbool.h>
+
+#define NTICKS   100
+#define INTERVAL 100000  // cycles; 10ms in qemu
+
+// entry.S needs one stack per CPU.
+__attribute__ ((aligned (16))) char stack0[STSIZE * NCPU];
+
+// entry.S jumps here in machine mode on stack0.
+void start(void) {
+    volatile uint64 *mtimecmp = (uint64 *) CLINT_MTIMECMP(0);
+    volatile uint64 *mtime = (uint64 *) CLINT_MTIME;
+
+    w_mie(r_mie() | MIE_MTIE);
+    for (int i = 0; i < NTICKS; i++) {
+        *mtimecmp = *mtime + INTERVAL;
+        while (*mtime < *mtimecmp)   // wfi may return early
+            asm volatile("wfi");
+    }
+
+    /* Illegal in every mode, so the hypervisor ends the VM. */
+    asm volatile("ebreak");
+    while (true);
+}
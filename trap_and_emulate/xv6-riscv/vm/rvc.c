@@ -0,0 +1,117 @@
+// Regression guest for compressed (RVC) code, built with
+// -march=rv64gc. Runs privileged instructions at addresses that
+// are 2 but not 4 byte aligned, one after compressed ones in the
+// same exit, and one that straddles a page, and makes compressed
+// loads and stores to the virtual CLINT; then reports through
+// the virtual UART and ends with C.EBREAK.
+// Run from the host shell with: vm-rvc
+//
+// Like vm-idle, it stays in M-mode, has its own start() and
+// needs no ramdisk.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#include <stdbool.h>
+
+// entry.S needs one stack per CPU.
+__attribute__ ((aligned (16))) char stack0[STSIZE * NCPU];
+
+#define Reg(reg) ((volatile unsigned char *)(UART0 + reg))
+#define THR 0                 // transmit holding register
+#define LSR 5                 // line status register
+#define LSR_TX_IDLE (1<<5)    // THR can accept another character
+
+static void uart_puts(char *s) {
+    for (; *s; s++) {
+        while ((*Reg(LSR) & LSR_TX_IDLE) == 0)
+            ;
+        *Reg(THR) = *s;
+    }
+}
+
+// Reads mscratch with a csrr whose two halves are in different
+// pages: 2047 compressed nops from a page boundary put it at
+// offset 4094.
+uint64 straddle(void);
+asm(".section .text.straddle, \"ax\"\n"
+    ".option push\n"
+    ".option rvc\n"
+    ".p2align 12\n"
+    ".globl straddle\n"
+    "straddle:\n"
+    ".rept 2047\n"
+    "c.nop\n"
+    ".endr\n"
+    "csrr a0, mscratch\n"
+    "c.jr ra\n"
+    ".option pop\n"
+    ".text\n");
+
+// Write v to mscratch and read it back at a 2-byte aligned pc,
+// the read batched into the write's exit, then add 1 with a
+// compressed instruction.
+static uint64 misaligned(uint64 v) {
+    uint64 x;
+
+    asm volatile(".option push\n"
+                 ".option rvc\n"
+                 ".p2align 2\n"
+                 "c.nop\n"
+                 "csrw mscratch, %1\n"
+                 "csrr %0, mscratch\n"
+                 "c.addi %0, 1\n"
+                 ".option pop\n"
+                 : "=&r" (x) : "r" (v));
+    return x;
+}
+
+// Compressed loads and stores to the CLINT: C.LD of mtime,
+// and C.SW and C.LW of the low half of mtimecmp.
+static int clint(void) {
+    register uint64 base asm("a0");
+    register uint64 val asm("a1");
+    register uint64 t asm("a2");
+
+    base = CLINT_MTIME;
+    asm volatile(".option push\n.option rvc\nc.ld %0, 0(%1)\n.option pop\n"
+                 : "=r" (t) : "r" (base));
+    if (t == 0)
+        return -1;
+
+    base = CLINT_MTIMECMP(0);
+    val = 0x12345678;
+    asm volatile(".option push\n.option rvc\nc.sw %0, 0(%1)\n.option pop\n"
+                 : : "r" (val), "r" (base) : "memory");
+    val = 0;
+    asm volatile(".option push\n.option rvc\nc.lw %0, 0(%1)\n.option pop\n"
+                 : "=r" (val) : "r" (base) : "memory");
+    *(volatile uint64 *) CLINT_MTIMECMP(0) = ~0UL;
+    return val == 0x12345678 ? 0 : -1;
+}
+
+// entry.S jumps here in machine mode on stack0.
+void start(void) {
+    char *failed = 0;
+
+    if (misaligned(41) != 42)
+        failed = "misaligned csr";
+    else if ((w_mscratch(0x5a5a), straddle()) != 0x5a5a)
+        failed = "csr across a page";
+    else if (clint() < 0)
+        failed = "compressed mmio";
+
+    if (failed) {
+        uart_puts("vm-rvc: failed: ");
+        uart_puts(failed);
+        uart_puts("\n");
+    } else
+        uart_puts("vm-rvc: ok\n");
+
+    /* Illegal in every mode, so the hypervisor ends the VM. */
+    asm volatile(".option push\n.option rvc\nc.ebreak\n.option pop\n");
+    while (true);
+}
@@ -0,0 +1,89 @@
+// Multi-vCPU guest, for scaling. Its harts share NCHUNK chunks
+// of busy work, each taking the next from a counter in shared
+// memory, so the work is done sooner the more vCPUs the VM has.
+// The hart that finishes the last chunk prints how long the
+// work took, and which harts did it, through the virtual UART.
+// Run from the host shell with: vmrun -c 3 vm-smp
+//
+// Like vm-idle, it has its own start() and needs no ramdisk.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#include <stdbool.h>
+
+#define NCHUNK 64
+#define CHUNK  1000000  // loop iterations per chunk
+
+// entry.S needs one stack per CPU.
+__attribute__ ((aligned (16))) char stack0[STSIZE * NCPU];
+
+static volatile uint64 t0;      // when the first hart started
+static int next;                // next chunk to take
+static int done;                // chunks finished
+static uint64 harts;            // harts that did any, as a bitmask
+static volatile uint64 result[NCHUNK];
+
+#define Reg(reg) ((volatile unsigned char *)(UART0 + reg))
+#define THR 0                 // transmit holding register
+#define LSR 5                 // line status register
+#define LSR_TX_IDLE (1<<5)    // THR can accept another character
+
+static void uart_puts(char *s) {
+    for (; *s; s++) {
+        while ((*Reg(LSR) & LSR_TX_IDLE) == 0)
+            ;
+        *Reg(THR) = *s;
+    }
+}
+
+static void uart_puthex(uint64 x) {
+    static const char digits[] = "0123456789abcdef";
+    char buf[19];
+
+    buf[0] = '0';
+    buf[1] = 'x';
+    for (int i = 0; i < 16; i++)
+        buf[2 + i] = digits[(x >> (60 - 4 * i)) & 0xF];
+    buf[18] = 0;
+    uart_puts(buf);
+}
+
+// One chunk of work, which only the CPU can do.
+static void work(int c) {
+    uint64 x = c;
+
+    for (int i = 0; i < CHUNK; i++)
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+    result[c] = x;
+}
+
+// entry.S jumps here in machine mode on stack0, on every hart.
+void start(void) {
+    volatile uint64 *mtime = (uint64 *) CLINT_MTIME;
+    uint64 id = r_mhartid();
+    int c;
+
+    __sync_bool_compare_and_swap(&t0, 0, *mtime);
+    while ((c = __sync_fetch_and_add(&next, 1)) < NCHUNK) {
+        work(c);
+        __sync_fetch_and_or(&harts, 1UL << id);
+        if (__sync_add_and_fetch(&done, 1) == NCHUNK) {
+            uart_puts("vm-smp: cycles ");
+            uart_puthex(*mtime - t0);
+            uart_puts(", harts ");
+            uart_puthex(harts);
+            uart_puts("\n");
+
+            /* Illegal in every mode, so the hypervisor ends the VM. */
+            asm volatile("ebreak");
+        }
+    }
+
+    // out of work: wait for the last chunk, and the VM's end.
+    while (true)
+        asm volatile("wfi");
+}